@@ -0,0 +1,266 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  dummy_bench.c
+ *
+ *    Description:  end-to-end benchmark for omimic on a loopback UDC (dummy_hcd).
+ *                  reports are written to /dev/omimic at fixed rates, tagged
+ *                  with a sequence number, and read back from the host side
+ *                  hidraw nodes. see dummy_bench.sh for the setup.
+ *
+ *                  usage: dummy_bench [-k kbd_rate] [-m mouse_rate] [-d seconds]
+ *                                     omimic_dev kbd_hidraw mouse_hidraw
+ *
+ *        Version:  1.0
+ *       Compiler:  gcc
+ *
+ *         Author:  l_amee (l_amee), l04m33@gmail.com
+ *        Company:  SYSU
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+
+#define KBD_BUFSIZE 8
+#define MOUSE_BUFSIZE 4
+#define NR_SEQ 65536
+#define GRACE_MS 500
+
+
+/*
+ * the 16-bit sequence number goes in the modifier and reserved bytes
+ * of kbd reports. mouse reports only have the button byte for an 8-bit
+ * one: the driver sums X/Y/wheel when reports collapse (sched_aligned,
+ * or while suspended), but keeps the buttons as written. the input
+ * nodes of the gadget are grabbed, so none of it reaches the console.
+ */
+struct stream {
+    const char *name;
+    int size;
+    int rate;
+    unsigned nr_seq;   /* a power of 2, NR_SEQ at most */
+    int ofd, ifd;
+
+    /* writer side */
+    double sent_at[NR_SEQ];
+    unsigned long sent, busy;
+
+    /* reader side */
+    unsigned long received, lost;
+    int last_seq;
+    double *lat;
+    unsigned long nr_lat, max_lat;
+};
+
+static struct stream kbd = { .name = "kbd", .size = KBD_BUFSIZE, .rate = 100,
+                             .nr_seq = 65536 };
+static struct stream mouse = { .name = "mouse", .size = MOUSE_BUFSIZE,
+                               .rate = 100, .nr_seq = 256 };
+static int duration = 10;
+static volatile int writing_done;
+
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void encode(struct stream *s, unsigned char *buf, unsigned seq)
+{
+    memset(buf, 0, s->size);
+    if(s->size == KBD_BUFSIZE){
+        buf[0] = seq >> 8;
+        buf[1] = seq & 0xff;
+    }else
+        buf[0] = seq;
+}
+
+static unsigned decode(struct stream *s, unsigned char *buf)
+{
+    if(s->size == KBD_BUFSIZE)
+        return (buf[0] << 8) | buf[1];
+    return buf[0];
+}
+
+/* keep the host input layer away from the test reports */
+static void grab_inputs(const char *hidraw)
+{
+    char pattern[256];
+    const char *name = strrchr(hidraw, '/');
+    glob_t g;
+    size_t i;
+    int fd;
+
+    name = name ? name + 1 : hidraw;
+    snprintf(pattern, sizeof(pattern),
+             "/sys/class/hidraw/%s/device/input/input*/event*", name);
+    if(glob(pattern, 0, NULL, &g)) return;
+    for(i=0; i<g.gl_pathc; i++){
+        snprintf(pattern, sizeof(pattern), "/dev/input/%s",
+                 strrchr(g.gl_pathv[i], '/') + 1);
+        fd = open(pattern, O_RDONLY);
+        if(fd < 0 || ioctl(fd, EVIOCGRAB, 1))
+            fprintf(stderr, "can't grab %s\n", pattern);
+        /* the fd is kept open for the grab to hold */
+    }
+    globfree(&g);
+}
+
+static void *writer(void *arg)
+{
+    struct stream *s = arg;
+    unsigned char buf[KBD_BUFSIZE];
+    struct timespec next;
+    unsigned long i, n = (unsigned long)s->rate * duration;
+    long step = 1000000000L / s->rate;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for(i=0; i<n; i++){
+        /* only accepted reports take a sequence number, so that 
+         * the gaps seen by the reader are reports lost on the way */
+        encode(s, buf, s->sent % s->nr_seq);
+        s->sent_at[s->sent % s->nr_seq] = now_us();
+        if(write(s->ofd, buf, s->size) == s->size)
+            s->sent++;
+        else if(errno == EBUSY)
+            s->busy++;
+        else{
+            fprintf(stderr, "%s: write error, abort.\n", s->name);
+            break;
+        }
+
+        next.tv_nsec += step;
+        while(next.tv_nsec >= 1000000000L){
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return NULL;
+}
+
+static void *reader(void *arg)
+{
+    struct stream *s = arg;
+    unsigned char buf[64];
+    struct pollfd pfd = { .fd = s->ifd, .events = POLLIN };
+    unsigned seq;
+    double t;
+    int ret;
+
+    s->last_seq = -1;
+    for(;;){
+        ret = poll(&pfd, 1, writing_done ? GRACE_MS : 100);
+        if(ret == 0 && writing_done) break;
+        if(ret <= 0) continue;
+        if(read(s->ifd, buf, sizeof(buf)) < s->size) continue;
+
+        t = now_us();
+        seq = decode(s, buf);
+        if(s->last_seq >= 0)
+            s->lost += (seq - s->last_seq - 1) & (s->nr_seq - 1);
+        s->last_seq = seq;
+        s->received++;
+        if(s->nr_lat < s->max_lat)
+            s->lat[s->nr_lat++] = t - s->sent_at[seq];
+    }
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(struct stream *s, double p)
+{
+    if(!s->nr_lat) return 0;
+    return s->lat[(unsigned long)(p * (s->nr_lat - 1))];
+}
+
+static void print_stream(struct stream *s)
+{
+    qsort(s->lat, s->nr_lat, sizeof(double), cmp_double);
+    printf("%-6s rate %5d/s: sent %lu, -EBUSY %lu, received %lu (%.1f/s), "
+           "lost %lu\n",
+           s->name, s->rate, s->sent, s->busy, s->received,
+           (double)s->received / duration, s->lost);
+    printf("%-6s latency us: p50 %.0f, p90 %.0f, p99 %.0f, max %.0f\n",
+           s->name, percentile(s, 0.5), percentile(s, 0.9),
+           percentile(s, 0.99), percentile(s, 1.0));
+}
+
+
+int main(int argc, char **argv)
+{
+    pthread_t threads[4];
+    struct stream *streams[2] = { &kbd, &mouse };
+    int opt, i, n = 0, ofd;
+
+    while((opt = getopt(argc, argv, "k:m:d:")) != -1){
+        switch(opt){
+        case 'k': kbd.rate = atoi(optarg); break;
+        case 'm': mouse.rate = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        default:
+            goto usage;
+        }
+    }
+    if(argc - optind < 3 || duration <= 0){
+usage:
+        fprintf(stderr, "usage: %s [-k kbd_rate] [-m mouse_rate] "
+                "[-d seconds] omimic_dev kbd_hidraw mouse_hidraw\n", argv[0]);
+        return 1;
+    }
+
+    ofd = open(argv[optind], O_WRONLY);
+    kbd.ifd = open(argv[optind+1], O_RDONLY);
+    mouse.ifd = open(argv[optind+2], O_RDONLY);
+    if(ofd < 0 || kbd.ifd < 0 || mouse.ifd < 0){
+        fprintf(stderr, "can't open the devices, abort.\n");
+        return 1;
+    }
+    grab_inputs(argv[optind+1]);
+    grab_inputs(argv[optind+2]);
+
+    for(i=0; i<2; i++){
+        streams[i]->ofd = ofd;
+        streams[i]->max_lat = (unsigned long)streams[i]->rate * duration;
+        streams[i]->lat = malloc(streams[i]->max_lat * sizeof(double));
+        if(streams[i]->rate <= 0 || !streams[i]->lat){
+            fprintf(stderr, "bad rate for %s, abort.\n", streams[i]->name);
+            return 1;
+        }
+    }
+
+    for(i=0; i<2; i++)
+        pthread_create(&threads[n++], NULL, reader, streams[i]);
+    for(i=0; i<2; i++)
+        pthread_create(&threads[n++], NULL, writer, streams[i]);
+    pthread_join(threads[2], NULL);
+    pthread_join(threads[3], NULL);
+    writing_done = 1;
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    for(i=0; i<2; i++)
+        print_stream(streams[i]);
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# end-to-end benchmark of omimic on the dummy_hcd loopback UDC.
+#
+# usage: dummy_bench.sh [g_omimic params...] [-- dummy_bench args...]
+#   e.g. dummy_bench.sh pool_depth=32 -- -k 1000 -m 1000 -d 10
+#
+# needs root, a kernel with dummy_hcd, and g_omimic.ko & dummy_bench
+# built in this directory.
+
+VID=2929
+PID=2929
+
+PARAMS=
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+    PARAMS="$PARAMS $1"
+    shift
+done
+[ "$1" = "--" ] && shift
+
+cd "$(dirname "$0")" || exit 1
+
+modprobe dummy_hcd || exit 1
+rmmod g_omimic 2>/dev/null
+insmod ./g_omimic.ko $PARAMS || exit 1
+trap 'rmmod g_omimic' EXIT
+
+# the char device, in case udev didn't create it
+if [ ! -c /dev/omimic ]; then
+    MAJOR=$(awk '$2 == "omimic" { print $1 }' /proc/devices)
+    mknod /dev/omimic c "$MAJOR" 0 || exit 1
+fi
+
+# wait for the host side to enumerate the gadget
+KBD=
+MOUSE=
+for i in $(seq 50); do
+    for h in /sys/class/hidraw/hidraw*; do
+        [ -e "$h" ] || continue
+        grep -qi "HID_ID=0003:0000$VID:0000$PID" "$h/device/uevent" || continue
+        case $(cat "$h/device/../bInterfaceNumber") in
+        00) KBD=/dev/$(basename "$h") ;;
+        01) MOUSE=/dev/$(basename "$h") ;;
+        esac
+    done
+    [ -n "$KBD" ] && [ -n "$MOUSE" ] && break
+    sleep 0.1
+done
+if [ -z "$KBD" ] || [ -z "$MOUSE" ]; then
+    echo "the gadget didn't show up on the host side, abort." >&2
+    exit 1
+fi
+
+echo "g_omimic$PARAMS: kbd=$KBD mouse=$MOUSE"
+./dummy_bench "$@" /dev/omimic "$KBD" "$MOUSE"
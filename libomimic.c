@@ -0,0 +1,635 @@
+/*
+ * =======================================================================
+ *
+ *       Filename:  libomimic.c
+ *
+ *    Description:  a client library for the omimic char device, see
+ *                  libomimic.h.
+ *
+ *        Version:  0.1
+ *       Compiler:  gcc
+ *
+ *         Author:  Kay Zheng (l_amee), l04m33@gmail.com
+ *
+ * =======================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+
+#include "libomimic.h"
+
+
+#define KBD_BUFSIZE 8
+#define MOUSE_BUFSIZE 4
+#define NR_KBD_KEYS 6
+#define NR_MOUSE_BTNS 3
+#define NR_PAD_BTNS 16
+#define PAD_HAT_NULL 8
+#define PAD_AXIS_MAX 32767
+#define BUSY_WAIT_US 200   /* back-off without a completion eventfd */
+#define BUSY_POLL_MS 100   /* in case a completion goes unsignaled */
+
+
+/*
+ * the state as the host will see it at the next flush. the *_touched
+ * bits mark what changed since the last report, a second change of
+ * the same key or button pushes that report out first.
+ */
+struct omimic {
+    int fd;
+    int efd;     /* the completion eventfd, -1 if the driver has none */
+    int flags;
+    omimic_report_fn hook;
+    void *hook_arg;
+
+    /* the usages held, and the non-modifier keys among them, oldest
+     * press first */
+    __u8 keys[32];
+    __u8 order[256];
+    int nr_order;
+    __u8 key_touched[32];
+    int kbd_dirty;
+
+    /* the buttons held, and the motion not reported yet */
+    __u8 btns;
+    __u8 btn_touched;
+    int dx, dy, wheel;
+    int mouse_dirty;
+
+    /* the gamepad report itself */
+    __u8 pad[OMIMIC_PAD_REPORT_SIZE];
+    __u16 pad_touched;
+    int pad_dirty;
+
+    struct omimic_stats stats;
+};
+
+
+static int test_bit8(const __u8 *map, int n)
+{
+    return map[n / 8] & (1 << (n % 8));
+}
+
+static void set_bit8(__u8 *map, int n, int on)
+{
+    if(on) map[n / 8] |= 1 << (n % 8);
+    else map[n / 8] &= ~(1 << (n % 8));
+}
+
+static int clamp(int v, int max)
+{
+    return v < -max ? -max : (v > max ? max : v);
+}
+
+
+/************* output **************/
+
+static void detach(struct omimic *);
+
+/*
+ * the host took a report, or some time passed without a completion
+ * eventfd. completions counted before the wait may be older than the
+ * write refused, so they only earn one more try. a full queue that
+ * doesn't move for BUSY_POLL_MS means another client took the eventfd
+ * of the node over (or the host stopped polling): the eventfd is let
+ * go, and the next waits back off like without one.
+ */
+static void wait_room(struct omimic *om)
+{
+    struct pollfd pfd = { .fd = om->efd, .events = POLLIN };
+    __u64 n;
+
+    if(om->efd < 0){
+        usleep(BUSY_WAIT_US);
+        return;
+    }
+    if(read(om->efd, &n, sizeof(n)) == sizeof(n)) return;
+    if(poll(&pfd, 1, BUSY_POLL_MS) > 0 
+       && read(om->efd, &n, sizeof(n)) == sizeof(n))
+        return;
+    detach(om);
+}
+
+/* returns 0, or -EBUSY on a full queue (unless waiting), or -errno */
+static int put_report(struct omimic *om, const void *buf, int len)
+{
+    ssize_t ret;
+
+    while(om->fd >= 0){
+        ret = write(om->fd, buf, len);
+        if(ret == len) break;
+        if(ret >= 0) return -EIO;
+        if(errno == EINTR) continue;
+        if(errno != EBUSY) return -errno;
+        om->stats.busy++;
+        if(!(om->flags & OMIMIC_WAIT)) return -EBUSY;
+        wait_room(om);
+    }
+    om->stats.reports++;
+    return 0;
+}
+
+/* the report has been sent, the hook sees it */
+static int sent(struct omimic *om, const void *buf, int len)
+{
+    return om->hook ? om->hook(om->hook_arg, buf, len) : 0;
+}
+
+static int flush_kbd(struct omimic *om)
+{
+    __u8 report[KBD_BUFSIZE];
+    int ret;
+
+    if(!om->kbd_dirty) return 0;
+    memset(report, 0, sizeof(report));
+    report[0] = om->keys[0xe0 / 8];  /* the modifiers, in usage order */
+    /* no rollover, the oldest keys win */
+    memcpy(report + 2, om->order,
+           om->nr_order < NR_KBD_KEYS ? om->nr_order : NR_KBD_KEYS);
+    ret = put_report(om, report, sizeof(report));
+    if(ret) return ret;
+    memset(om->key_touched, 0, sizeof(om->key_touched));
+    om->kbd_dirty = 0;
+    return sent(om, report, sizeof(report));
+}
+
+/* motion beyond the report range goes out in more reports */
+static int flush_mouse(struct omimic *om)
+{
+    __u8 report[MOUSE_BUFSIZE];
+    int dx, dy, dw, ret;
+
+    while(om->mouse_dirty){
+        dx = clamp(om->dx, 127);
+        dy = clamp(om->dy, 127);
+        dw = clamp(om->wheel, 127);
+        report[0] = om->btns;
+        report[1] = dx;
+        report[2] = dy;
+        report[3] = dw;
+        ret = put_report(om, report, sizeof(report));
+        if(ret) return ret;
+        om->dx -= dx;
+        om->dy -= dy;
+        om->wheel -= dw;
+        om->btn_touched = 0;
+        om->mouse_dirty = om->dx || om->dy || om->wheel;
+        ret = sent(om, report, sizeof(report));
+        if(ret) return ret;
+    }
+    return 0;
+}
+
+static int flush_pad(struct omimic *om)
+{
+    int ret;
+
+    if(!om->pad_dirty) return 0;
+    ret = put_report(om, om->pad, sizeof(om->pad));
+    if(ret) return ret;
+    om->pad_touched = 0;
+    om->pad_dirty = 0;
+    return sent(om, om->pad, sizeof(om->pad));
+}
+
+/*
+ * the endpoints have their own queues: a full one doesn't hold the
+ * others back, the first error is returned.
+ */
+int omimic_flush(struct omimic *om)
+{
+    int ret, tmp;
+
+    om->stats.flushes++;
+    ret = flush_kbd(om);
+    tmp = flush_mouse(om);
+    if(!ret) ret = tmp;
+    tmp = flush_pad(om);
+    return ret ? ret : tmp;
+}
+
+/* a device at rest (nothing held, the gamepad centered) is left out */
+void omimic_resend(struct omimic *om)
+{
+    __u8 rest[OMIMIC_PAD_REPORT_SIZE] = { 0 };
+    int i;
+
+    for(i=0; i<(int)sizeof(om->keys) && !om->keys[i]; i++);
+    if(i < (int)sizeof(om->keys)) om->kbd_dirty = 1;
+    if(om->btns) om->mouse_dirty = 1;
+    rest[2] = PAD_HAT_NULL;
+    if(memcmp(om->pad, rest, sizeof(rest))) om->pad_dirty = 1;
+}
+
+int omimic_put_report(struct omimic *om, const void *report, int len)
+{
+    int ret = put_report(om, report, len);
+    return ret ? ret : sent(om, report, len);
+}
+
+
+/************* state **************/
+
+static int key_change(struct omimic *om, int usage, int down)
+{
+    int i, ret;
+
+    if(usage <= 0 || usage > 0xff) return -EINVAL;
+    if(!!test_bit8(om->keys, usage) == down) return 0;
+    if(test_bit8(om->key_touched, usage) && (ret = flush_kbd(om)))
+        return ret;
+    set_bit8(om->keys, usage, down);
+
+    if(usage < 0xe0 || usage > 0xe7){
+        if(down)
+            om->order[om->nr_order++] = usage;
+        else{
+            for(i=0; i<om->nr_order && om->order[i] != usage; i++);
+            memmove(&om->order[i], &om->order[i+1], om->nr_order - i - 1);
+            om->nr_order--;
+        }
+    }
+    set_bit8(om->key_touched, usage, 1);
+    om->kbd_dirty = 1;
+    return 0;
+}
+
+int omimic_key_down(struct omimic *om, int usage)
+{
+    return key_change(om, usage, 1);
+}
+
+int omimic_key_up(struct omimic *om, int usage)
+{
+    return key_change(om, usage, 0);
+}
+
+static int btn_change(struct omimic *om, int btn, int down)
+{
+    __u8 mask = 1 << btn;
+    int ret;
+
+    if(btn < 0 || btn >= NR_MOUSE_BTNS) return -EINVAL;
+    if(!!(om->btns & mask) == down) return 0;
+    /* the motion so far goes before the click, for drags */
+    if(((om->btn_touched & mask) || om->dx || om->dy || om->wheel)
+       && (ret = flush_mouse(om)))
+        return ret;
+    if(down) om->btns |= mask;
+    else om->btns &= ~mask;
+    om->btn_touched |= mask;
+    om->mouse_dirty = 1;
+    return 0;
+}
+
+int omimic_btn_down(struct omimic *om, int btn)
+{
+    return btn_change(om, btn, 1);
+}
+
+int omimic_btn_up(struct omimic *om, int btn)
+{
+    return btn_change(om, btn, 0);
+}
+
+int omimic_mouse_move(struct omimic *om, int dx, int dy, int wheel)
+{
+    if(!dx && !dy && !wheel) return 0;
+    om->dx += dx;
+    om->dy += dy;
+    om->wheel += wheel;
+    om->mouse_dirty = 1;
+    return 0;
+}
+
+static int pad_btn_change(struct omimic *om, int btn, int down)
+{
+    __u8 *byte = &om->pad[btn / 8];
+    __u8 mask = 1 << (btn % 8);
+    int ret;
+
+    if(btn < 0 || btn >= NR_PAD_BTNS) return -EINVAL;
+    if(!!(*byte & mask) == down) return 0;
+    if((om->pad_touched & (1 << btn)) && (ret = flush_pad(om)))
+        return ret;
+    if(down) *byte |= mask;
+    else *byte &= ~mask;
+    om->pad_touched |= 1 << btn;
+    om->pad_dirty = 1;
+    return 0;
+}
+
+int omimic_pad_btn_down(struct omimic *om, int btn)
+{
+    return pad_btn_change(om, btn, 1);
+}
+
+int omimic_pad_btn_up(struct omimic *om, int btn)
+{
+    return pad_btn_change(om, btn, 0);
+}
+
+/* absolute, the latest value before the flush wins */
+int omimic_pad_axis(struct omimic *om, int axis, int value)
+{
+    __u8 *p;
+    __u8 hat;
+
+    if(axis == OMIMIC_PAD_HAT){
+        hat = value >= 0 && value < PAD_HAT_NULL ? value : PAD_HAT_NULL;
+        if((om->pad[2] & 0x0f) == hat) return 0;
+        om->pad[2] = (om->pad[2] & 0xf0) | hat;
+    }else if(axis >= OMIMIC_PAD_X && axis <= OMIMIC_PAD_RY){
+        value = clamp(value, PAD_AXIS_MAX);
+        p = &om->pad[3 + 2 * axis];
+        if(p[0] == (value & 0xff) && p[1] == ((value >> 8) & 0xff))
+            return 0;
+        p[0] = value & 0xff;
+        p[1] = (value >> 8) & 0xff;
+    }else
+        return -EINVAL;
+    om->pad_dirty = 1;
+    return 0;
+}
+
+int omimic_key_held(const struct omimic *om, int usage)
+{
+    if(usage <= 0 || usage > 0xff) return 0;
+    return !!test_bit8(om->keys, usage);
+}
+
+
+/************* text **************/
+
+#define MOD_SHIFT 0x02   /* the left shift */
+#define MOD_ALTGR 0x40   /* the right alt */
+#define ISO_KEY   0x64
+
+struct keystroke {
+    __u8 usage;   /* 0 if the layout can't type the character */
+    __u8 mods;
+};
+
+static const wchar_t us_plain[OMIMIC_LAYOUT_KEYS + 1] =
+    L"abcdefghijklmnopqrstuvwxyz" L"1234567890" L"\n\x1b\b\t "
+    L"-=[]\\" L"\0" L";'`,./";
+static const wchar_t us_shift[OMIMIC_LAYOUT_KEYS + 1] =
+    L"ABCDEFGHIJKLMNOPQRSTUVWXYZ" L"!@#$%^&*()" L"\0\0\0\0\0"
+    L"_+{}|" L"\0" L":\"~<>?";
+
+/* the dead keys (^, ´ and `) are left out */
+static const wchar_t de_plain[OMIMIC_LAYOUT_KEYS + 1] =
+    L"abcdefghijklmnopqrstuvwxzy" L"1234567890" L"\n\x1b\b\t "
+    L"ß\0ü+\0" L"#" L"öä\0,.-";
+static const wchar_t de_shift[OMIMIC_LAYOUT_KEYS + 1] =
+    L"ABCDEFGHIJKLMNOPQRSTUVWXZY" L"!\"§$%&/()=" L"\0\0\0\0\0"
+    L"?\0Ü*\0" L"'" L"ÖÄ°;:_";
+static const wchar_t de_altgr[OMIMIC_LAYOUT_KEYS + 1] =
+    L"\0\0\0\0€\0\0\0\0\0\0\0µ\0\0\0@\0\0\0\0\0\0\0\0\0"
+    L"\0²³\0\0\0{[]}" L"\0\0\0\0\0" L"\\\0\0~\0" L"\0" L"\0\0\0\0\0\0";
+
+static const struct omimic_layout layouts[] = {
+    { "us", us_plain, us_shift, NULL, { 0, 0, 0 } },
+    { "de", de_plain, de_shift, de_altgr, { L'<', L'>', L'|' } },
+};
+
+const struct omimic_layout *omimic_find_layout(const char *name)
+{
+    size_t i;
+
+    for(i=0; i<sizeof(layouts) / sizeof(layouts[0]); i++)
+        if(!strcmp(layouts[i].name, name)) return &layouts[i];
+    return NULL;
+}
+
+/* the key typing ch, with the fewest modifiers */
+static struct keystroke find_key(const struct omimic_layout *layout,
+                                 wchar_t ch)
+{
+    static const __u8 level_mods[3] = { 0, MOD_SHIFT, MOD_ALTGR };
+    const wchar_t *rows[3] = { layout->plain, layout->shift, layout->altgr };
+    struct keystroke ks = { 0, 0 };
+    int i, j;
+
+    if(!ch) return ks;
+    for(i=0; i<3; i++){
+        if(!rows[i]) continue;
+        for(j=0; j<OMIMIC_LAYOUT_KEYS && rows[i][j] != ch; j++);
+        if(j < OMIMIC_LAYOUT_KEYS)
+            ks.usage = 0x04 + j;
+        else if(layout->iso[i] == ch)
+            ks.usage = ISO_KEY;
+        else
+            continue;
+        ks.mods = level_mods[i];
+        break;
+    }
+    return ks;
+}
+
+/* the next character, -1 (and s left alone) if it isn't valid UTF-8 */
+static long utf8_next(const unsigned char **s)
+{
+    static const long min[4] = { 0, 0x80, 0x800, 0x10000 };
+    const unsigned char *p = *s;
+    long c;
+    int n, i;
+
+    if(*p < 0x80){
+        n = 0;
+        c = *p;
+    }else if((*p & 0xe0) == 0xc0){
+        n = 1;
+        c = *p & 0x1f;
+    }else if((*p & 0xf0) == 0xe0){
+        n = 2;
+        c = *p & 0x0f;
+    }else if((*p & 0xf8) == 0xf0){
+        n = 3;
+        c = *p & 0x07;
+    }else
+        return -1;
+    for(i=1; i<=n; i++){
+        if((p[i] & 0xc0) != 0x80) return -1;
+        c = (c << 6) | (p[i] & 0x3f);
+    }
+    /* overlong forms and surrogates aren't characters */
+    if(c < min[n] || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+        return -1;
+    *s = p + n + 1;
+    return c;
+}
+
+static int has_key(const __u8 *report, int usage)
+{
+    return memchr(report + 2, usage, NR_KBD_KEYS) != NULL;
+}
+
+/* send cur, which becomes prev */
+static int put_text_report(struct omimic *om, __u8 *cur, __u8 *prev)
+{
+    int ret = put_report(om, cur, KBD_BUFSIZE);
+
+    if(!ret) ret = sent(om, cur, KBD_BUFSIZE);
+    memcpy(prev, cur, KBD_BUFSIZE);
+    memset(cur, 0, KBD_BUFSIZE);
+    return ret;
+}
+
+/*
+ * a host takes the keys new in a report in the order of the report,
+ * after the modifiers. so a report presses the next keys of the text
+ * as long as they need the same modifiers and none of them is still
+ * down from the report before; that one is cut short, or released
+ * by an extra report when it comes first.
+ */
+int omimic_type(struct omimic *om, const char *utf8,
+                const struct omimic_layout *layout, int per_report)
+{
+    static const __u8 up[KBD_BUFSIZE];
+    const unsigned char *p = (const unsigned char *)utf8;
+    struct keystroke ascii[128], *keys, *k;
+    __u8 prev[KBD_BUFSIZE], cur[KBD_BUFSIZE];
+    int nr = 0, n = 0, i, flags, reports = 0, ret = 0;
+    long c;
+
+    if(per_report <= 0 || per_report > NR_KBD_KEYS)
+        per_report = NR_KBD_KEYS;
+    for(i=0; i<(int)sizeof(om->keys); i++)
+        if(om->keys[i]) return -EBUSY;
+
+    /* every key first, a text that can't be typed sends nothing */
+    keys = malloc((strlen(utf8) + 1) * sizeof(*keys));
+    if(!keys) return -ENOMEM;
+    for(i=0; i<128; i++)
+        ascii[i] = find_key(layout, i);
+    while(*p){
+        c = utf8_next(&p);
+        if(c < 0){
+            ret = -EILSEQ;
+            goto out;
+        }
+        if(c == '\r' && *p == '\n') continue;  /* one Enter for CRLF */
+        keys[nr] = c < 128 ? ascii[c] : find_key(layout, c);
+        if(!keys[nr].usage){
+            ret = -EILSEQ;
+            goto out;
+        }
+        nr++;
+    }
+
+    flags = om->flags;
+    om->flags |= OMIMIC_WAIT;
+    ret = flush_kbd(om);  /* the releases still pending */
+    memset(prev, 0, sizeof(prev));
+    memset(cur, 0, sizeof(cur));
+    for(i=0; i<nr && !ret; i++){
+        k = &keys[i];
+        if(n && (k->mods != cur[0] || n == per_report
+                 || has_key(cur, k->usage) || has_key(prev, k->usage))){
+            ret = put_text_report(om, cur, prev);
+            reports++;
+            n = 0;
+            if(ret) break;
+        }
+        if(!n && has_key(prev, k->usage)){
+            /* typed again, the modifiers stay down for the run */
+            cur[0] = k->mods;
+            ret = put_text_report(om, cur, prev);
+            reports++;
+            if(ret) break;
+        }
+        cur[0] = k->mods;
+        cur[2 + n++] = k->usage;
+    }
+    if(!ret && n){
+        ret = put_text_report(om, cur, prev);
+        reports++;
+    }
+    /* all up, as the state has it */
+    if(!ret && memcmp(prev, up, KBD_BUFSIZE)){
+        ret = put_text_report(om, cur, prev);
+        reports++;
+    }
+    om->flags = flags;
+out:
+    free(keys);
+    return ret ? ret : reports;
+}
+
+
+/************* setup **************/
+
+/*
+ * the driver signals one eventfd per node: another client on the same
+ * node takes it over, and wait_room() lets this one go when it sees
+ * that.
+ */
+static void attach(struct omimic *om, int fd)
+{
+    om->fd = fd;
+    om->efd = -1;
+    if(fd < 0) return;
+    om->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(om->efd >= 0
+       && ioctl(fd, OMIMIC_IOC_COMPLETION_EVENTFD, &om->efd)){
+        /* an older driver, or not the device at all */
+        close(om->efd);
+        om->efd = -1;
+    }
+}
+
+static void detach(struct omimic *om)
+{
+    int none = -1;
+
+    if(om->efd < 0) return;
+    ioctl(om->fd, OMIMIC_IOC_COMPLETION_EVENTFD, &none);
+    close(om->efd);
+    om->efd = -1;
+}
+
+struct omimic *omimic_new(int fd, int flags)
+{
+    struct omimic *om = calloc(1, sizeof(*om));
+
+    if(!om) return NULL;
+    om->flags = flags;
+    om->pad[2] = PAD_HAT_NULL;
+    attach(om, fd);
+    return om;
+}
+
+void omimic_set_fd(struct omimic *om, int fd)
+{
+    detach(om);
+    attach(om, fd);
+}
+
+void omimic_free(struct omimic *om)
+{
+    detach(om);
+    free(om);
+}
+
+void omimic_set_hook(struct omimic *om, omimic_report_fn fn, void *arg)
+{
+    om->hook = fn;
+    om->hook_arg = arg;
+}
+
+int omimic_poll_fd(const struct omimic *om)
+{
+    return om->efd;
+}
+
+const struct omimic_stats *omimic_stats(const struct omimic *om)
+{
+    return &om->stats;
+}
@@ -0,0 +1,125 @@
+/*
+ * =======================================================================
+ *
+ *       Filename:  libomimic.h
+ *
+ *    Description:  a client library for the omimic char device. it keeps
+ *                  the keyboard, mouse and gamepad state, merges the
+ *                  changes made between two flushes into as few reports
+ *                  as possible, and waits for room when the queue of an
+ *                  endpoint is full.
+ *
+ *        Version:  0.1
+ *       Compiler:  gcc
+ *
+ *         Author:  Kay Zheng (l_amee), l04m33@gmail.com
+ *
+ * =======================================================================
+ */
+
+#ifndef LIBOMIMIC_H
+#define LIBOMIMIC_H
+
+#include <stddef.h>
+
+#include "omimic.h"
+
+
+/*
+ * omimic_new() flags.
+ * without OMIMIC_WAIT, a flush that finds a queue full returns -EBUSY
+ * and keeps the changes not sent yet; they are merged with the next
+ * ones and go out at a later flush. poll omimic_poll_fd() for room.
+ */
+#define OMIMIC_WAIT 0x1   /* block until the reports are queued */
+
+/*
+ * called with every report once it has been written, e.g. to capture
+ * the reports. a non-zero return is returned by the call that sent
+ * the report (a flush, a state change pushing reports out, ...); the
+ * report has gone out all the same.
+ */
+typedef int (*omimic_report_fn)(void *arg, const void *report, int len);
+
+struct omimic_stats {
+    unsigned long reports;  /* reports written */
+    unsigned long busy;     /* writes refused with -EBUSY */
+    unsigned long flushes;
+};
+
+struct omimic;
+
+/*
+ * fd is /dev/omimic, or any file taking the reports as written. with
+ * fd < 0, the reports only go to the report hook. the fd is not
+ * closed by omimic_free().
+ */
+struct omimic *omimic_new(int fd, int flags);
+void omimic_free(struct omimic *);
+void omimic_set_hook(struct omimic *, omimic_report_fn, void *arg);
+/* the state is kept, the next changes go out to fd */
+void omimic_set_fd(struct omimic *, int fd);
+
+/*
+ * the state changes. they return 0, or a negative errno when the
+ * change needs the reports so far out first (a key pressed and
+ * released before a flush) and they could not be sent.
+ */
+int omimic_key_down(struct omimic *, int usage);  /* HID usage */
+int omimic_key_up(struct omimic *, int usage);
+int omimic_btn_down(struct omimic *, int btn);    /* 0-2 */
+int omimic_btn_up(struct omimic *, int btn);
+int omimic_mouse_move(struct omimic *, int dx, int dy, int wheel);
+int omimic_pad_btn_down(struct omimic *, int btn);  /* 0-15 */
+int omimic_pad_btn_up(struct omimic *, int btn);
+int omimic_pad_axis(struct omimic *, int axis, int value); /* OMIMIC_PAD_* */
+
+/* send what changed since the last flush. returns 0 or -errno */
+int omimic_flush(struct omimic *);
+/* the next flush sends the whole state again, what is held at least 
+ * (e.g. to a new fd, which hasn't seen it) */
+void omimic_resend(struct omimic *);
+/* a whole report as is, e.g. replayed; the state is left alone */
+int omimic_put_report(struct omimic *, const void *report, int len);
+
+/*
+ * a keyboard layout: the characters typed by the usages from 0x04 (a
+ * on US keyboards) to 0x38 (/), alone, with shift, and with AltGr
+ * (the right alt). 0 where a key types nothing, e.g. a dead key. the
+ * ISO key left of z (usage 0x64) comes apart.
+ */
+#define OMIMIC_LAYOUT_KEYS (0x38 - 0x04 + 1)
+
+struct omimic_layout {
+    const char *name;
+    const wchar_t *plain;   /* OMIMIC_LAYOUT_KEYS characters each */
+    const wchar_t *shift;
+    const wchar_t *altgr;   /* NULL without an AltGr level */
+    wchar_t iso[3];         /* plain, shift, AltGr of usage 0x64 */
+};
+
+/* "us", "de", or NULL if unknown */
+const struct omimic_layout *omimic_find_layout(const char *name);
+
+/*
+ * type a UTF-8 text in as few reports as the host can tell apart:
+ * up to per_report keys (1-6, 0 for 6) go down in one report, in the
+ * order of the text, while they need the same modifiers; a key is
+ * only released in between when it is typed again. this waits for
+ * room whatever the flags, and needs no key held when called.
+ * returns the number of reports, -EILSEQ if the text is not valid
+ * UTF-8 or has a character the layout can't type (nothing is sent
+ * then), -EBUSY if a key is held, or -errno.
+ */
+int omimic_type(struct omimic *, const char *utf8,
+                const struct omimic_layout *, int per_report);
+
+int omimic_key_held(const struct omimic *, int usage);
+/*
+ * readable when the host has taken a report, -1 if unknown. it turns
+ * -1 once another client on the node has taken the signal over.
+ */
+int omimic_poll_fd(const struct omimic *);
+const struct omimic_stats *omimic_stats(const struct omimic *);
+
+#endif
@@ -0,0 +1,679 @@
+/*
+ * =======================================================================
+ *
+ *       Filename:  kshim.c
+ *
+ *    Description:  a mock UDC and the bits of the kernel that omimic.c
+ *                  needs, so the driver runs as a plain process.
+ *                  the "host" is the harness: it sends control requests
+ *                  with kshim_host_setup() and takes reports from the
+ *                  endpoint queues with kshim_host_poll().
+ *
+ *        Version:  0.1
+ *       Compiler:  gcc
+ *
+ *         Author:  Kay Zheng (l_amee), l04m33@gmail.com
+ *
+ * =======================================================================
+ */
+
+#include <linux/kernel.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/gadget.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/splice.h>
+#include <linux/eventfd.h>
+#include <unistd.h>
+
+
+#define NR_EPS 6
+#define NR_PARAMS 32
+#define NR_CDEVS 8
+#define EP0_BUFSIZE 1024
+#define CHRDEV_MAJOR 250
+#define NR_TIMERS 8
+#define NR_HRTIMERS 8
+
+
+int kshim_verbose = 0;
+s64 kshim_clock_ns = 0;
+struct class input_class = { .name = "input" };
+
+struct usb_gadget *kshim_gadget;
+struct usb_gadget_driver *kshim_driver;
+
+static struct usb_ep eps[NR_EPS];
+static pthread_mutex_t ep_mutex[NR_EPS];
+static const char *ep_names[NR_EPS] = {
+    "ep0", "ep1in-int", "ep2in-int", "ep3in-int", "ep4in-int", "ep5in-int",
+};
+
+static struct usb_gadget gadget = {
+    .ep0 = &eps[0],
+    .speed = USB_SPEED_FULL,
+    .name = "kshim_udc",
+};
+
+/* ep0 data stage, IN from the gadget */
+static u8 ep0_buf[EP0_BUFSIZE];
+static int ep0_len;
+/* ep0 data stage, OUT from the host */
+static const void *ep0_out;
+static int ep0_out_len;
+
+static struct {
+    const char *name;
+    int *val;
+} params[NR_PARAMS];
+static int nr_params;
+
+static struct timer_list *timers[NR_TIMERS];
+static struct hrtimer *hrtimers[NR_HRTIMERS];
+
+static struct cdev *cdevs[NR_CDEVS];
+static int nr_cdevs;
+static unsigned next_minor;
+
+
+/************* module parameters **************/
+
+void kshim_register_param(const char *name, int *val)
+{
+    if(nr_params < NR_PARAMS){
+        params[nr_params].name = name;
+        params[nr_params].val = val;
+        nr_params++;
+    }
+}
+
+int kshim_set_param(const char *name, int val)
+{
+    int i;
+    for(i=0; i<nr_params; i++){
+        if(!strcmp(params[i].name, name)){
+            *params[i].val = val;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+
+/************* timers **************/
+
+void setup_timer(struct timer_list *t, void (*fn)(unsigned long), 
+                 unsigned long data)
+{
+    int i;
+
+    t->function = fn;
+    t->data = data;
+    t->pending = 0;
+    for(i=0; i<NR_TIMERS && timers[i] && timers[i] != t; i++);
+    if(i < NR_TIMERS) timers[i] = t;
+}
+
+int mod_timer(struct timer_list *t, unsigned long expires)
+{
+    int pending = t->pending;
+
+    t->expires = expires;
+    t->pending = 1;
+    return pending;
+}
+
+int del_timer_sync(struct timer_list *t)
+{
+    int i, pending = t->pending;
+
+    t->pending = 0;
+    /* the timer may be freed after this */
+    for(i=0; i<NR_TIMERS; i++)
+        if(timers[i] == t) timers[i] = NULL;
+    return pending;
+}
+
+void kshim_run_timers(void)
+{
+    struct timer_list *t;
+    int i;
+
+    for(i=0; i<NR_TIMERS; i++){
+        t = timers[i];
+        if(!t || !t->pending || (long)(jiffies - t->expires) < 0) continue;
+        t->pending = 0;
+        t->function(t->data);
+    }
+}
+
+
+/************* hrtimers **************/
+
+void hrtimer_init(struct hrtimer *t, clockid_t clock, enum hrtimer_mode mode)
+{
+    int i;
+
+    (void)clock;
+    (void)mode;
+    memset(t, 0, sizeof(*t));
+    for(i=0; i<NR_HRTIMERS && hrtimers[i] && hrtimers[i] != t; i++);
+    if(i < NR_HRTIMERS) hrtimers[i] = t;
+}
+
+int hrtimer_start(struct hrtimer *t, ktime_t tim, enum hrtimer_mode mode)
+{
+    int active = t->active;
+
+    if(mode == HRTIMER_MODE_REL) tim.tv64 += kshim_clock_ns;
+    t->expires = tim;
+    t->active = 1;
+    return active;
+}
+
+int hrtimer_try_to_cancel(struct hrtimer *t)
+{
+    int active = t->active;
+    t->active = 0;
+    return active;
+}
+
+int hrtimer_cancel(struct hrtimer *t)
+{
+    int i, active = hrtimer_try_to_cancel(t);
+
+    /* the timer may be freed after this */
+    for(i=0; i<NR_HRTIMERS; i++)
+        if(hrtimers[i] == t) hrtimers[i] = NULL;
+    return active;
+}
+
+void kshim_run_hrtimers(void)
+{
+    struct hrtimer *t;
+    int i;
+
+    for(i=0; i<NR_HRTIMERS; i++){
+        t = hrtimers[i];
+        if(!t || !t->active || t->expires.tv64 > kshim_clock_ns) continue;
+        t->active = 0;
+        if(t->function(t) == HRTIMER_RESTART) t->active = 1;
+    }
+}
+
+
+/************* gadget API **************/
+
+int usb_gadget_register_driver(struct usb_gadget_driver *driver)
+{
+    int i;
+
+    if(kshim_driver) return -EBUSY;
+    for(i=0; i<NR_EPS; i++){
+        eps[i].name = ep_names[i];
+        eps[i].maxpacket = 64;
+        INIT_LIST_HEAD(&eps[i].queue);
+        pthread_mutex_init(&ep_mutex[i], NULL);
+    }
+    kshim_driver = driver;
+    kshim_gadget = &gadget;
+    return 0;
+}
+
+int usb_gadget_unregister_driver(struct usb_gadget_driver *driver)
+{
+    if(driver != kshim_driver) return -EINVAL;
+    kshim_driver = NULL;
+    return 0;
+}
+
+void usb_ep_autoconfig_reset(struct usb_gadget *g)
+{
+    int i;
+    (void)g;
+    for(i=1; i<NR_EPS; i++)
+        eps[i].claimed = 0;
+}
+
+struct usb_ep *usb_ep_autoconfig(struct usb_gadget *g,
+                                 struct usb_endpoint_descriptor *desc)
+{
+    int i;
+    (void)g;
+    for(i=1; i<NR_EPS; i++){
+        if(!eps[i].claimed){
+            eps[i].claimed = 1;
+            desc->bEndpointAddress |= i;
+            return &eps[i];
+        }
+    }
+    return NULL;
+}
+
+int usb_ep_enable(struct usb_ep *ep, const struct usb_endpoint_descriptor *d)
+{
+    ep->desc = d;
+    ep->enabled = 1;
+    return 0;
+}
+
+static int ep_index(struct usb_ep *ep)
+{
+    return ep - eps;
+}
+
+/* like most UDCs, give the queued requests back with -ESHUTDOWN */
+int usb_ep_disable(struct usb_ep *ep)
+{
+    struct usb_request *req;
+    pthread_mutex_t *m = &ep_mutex[ep_index(ep)];
+
+    pthread_mutex_lock(m);
+    ep->enabled = 0;
+    while(!list_empty(&ep->queue)){
+        req = list_entry(ep->queue.next, struct usb_request, list);
+        list_del(&req->list);
+        ep->nr_queued--;
+        pthread_mutex_unlock(m);
+        req->status = -ESHUTDOWN;
+        req->actual = 0;
+        req->complete(ep, req);
+        pthread_mutex_lock(m);
+    }
+    pthread_mutex_unlock(m);
+    return 0;
+}
+
+struct usb_request *usb_ep_alloc_request(struct usb_ep *ep, gfp_t flags)
+{
+    (void)ep;
+    (void)flags;
+    return calloc(1, sizeof(struct usb_request));
+}
+
+void usb_ep_free_request(struct usb_ep *ep, struct usb_request *req)
+{
+    (void)ep;
+    free(req);
+}
+
+int usb_ep_queue(struct usb_ep *ep, struct usb_request *req, gfp_t flags)
+{
+    pthread_mutex_t *m = &ep_mutex[ep_index(ep)];
+    (void)flags;
+
+    /* control transfers complete right away */
+    if(ep == &eps[0]){
+        if(ep0_out){
+            req->actual = min(req->length, (unsigned)ep0_out_len);
+            memcpy(req->buf, ep0_out, req->actual);
+            ep0_out = NULL;
+        }else{
+            ep0_len = min(req->length, (unsigned)EP0_BUFSIZE);
+            memcpy(ep0_buf, req->buf, ep0_len);
+            req->actual = req->length;
+        }
+        req->status = 0;
+        req->complete(ep, req);
+        return 0;
+    }
+
+    pthread_mutex_lock(m);
+    if(!ep->enabled){
+        pthread_mutex_unlock(m);
+        return -ESHUTDOWN;
+    }
+    req->status = -EINPROGRESS;
+    req->actual = 0;
+    list_add_tail(&req->list, &ep->queue);
+    ep->nr_queued++;
+    pthread_mutex_unlock(m);
+    return 0;
+}
+
+int usb_ep_dequeue(struct usb_ep *ep, struct usb_request *req)
+{
+    struct usb_request *r;
+    pthread_mutex_t *m = &ep_mutex[ep_index(ep)];
+
+    pthread_mutex_lock(m);
+    list_for_each_entry(r, &ep->queue, list){
+        if(r == req){
+            list_del(&req->list);
+            ep->nr_queued--;
+            pthread_mutex_unlock(m);
+            req->status = -ECONNRESET;
+            req->complete(ep, req);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(m);
+    return -EINVAL;
+}
+
+int usb_gadget_frame_number(struct usb_gadget *g)
+{
+    (void)g;
+    return (kshim_clock_ns / 1000000) & 0x7ff;
+}
+
+int usb_gadget_wakeup(struct usb_gadget *g)
+{
+    (void)g;
+    return 0;
+}
+
+int usb_gadget_set_selfpowered(struct usb_gadget *g)
+{
+    (void)g;
+    return 0;
+}
+
+/* from drivers/usb/gadget/config.c */
+int usb_gadget_config_buf(const struct usb_config_descriptor *config,
+                          void *buf, unsigned length,
+                          const struct usb_descriptor_header **desc)
+{
+    struct usb_config_descriptor *cp = buf;
+    u8 *next = (u8 *)buf + USB_DT_CONFIG_SIZE;
+    unsigned len = USB_DT_CONFIG_SIZE;
+
+    if(length < USB_DT_CONFIG_SIZE || !desc) return -EINVAL;
+    *cp = *config;
+
+    for(; *desc; desc++){
+        if(len + (*desc)->bLength > length) return -EINVAL;
+        memcpy(next, *desc, (*desc)->bLength);
+        next += (*desc)->bLength;
+        len += (*desc)->bLength;
+    }
+
+    cp->bLength = USB_DT_CONFIG_SIZE;
+    cp->bDescriptorType = USB_DT_CONFIG;
+    cp->wTotalLength = cpu_to_le16(len);
+    cp->bmAttributes |= USB_CONFIG_ATT_ONE;
+    return len;
+}
+
+/* from drivers/usb/gadget/usbstring.c, ascii only */
+int usb_gadget_get_string(struct usb_gadget_strings *table, int id, u8 *buf)
+{
+    struct usb_string *s;
+    int len, i;
+
+    if(id == 0){
+        buf[0] = 4;
+        buf[1] = USB_DT_STRING;
+        buf[2] = table->language & 0xff;
+        buf[3] = table->language >> 8;
+        return 4;
+    }
+    for(s = table->strings; s && s->s; s++)
+        if(s->id == id) break;
+    if(!s || !s->s) return -EINVAL;
+
+    len = min((int)strlen(s->s), 126);
+    for(i=0; i<len; i++){
+        buf[2 + 2*i] = s->s[i];
+        buf[3 + 2*i] = 0;
+    }
+    buf[0] = (len + 1) * 2;
+    buf[1] = USB_DT_STRING;
+    return buf[0];
+}
+
+
+/************* char devices **************/
+
+int alloc_chrdev_region(dev_t *dev, unsigned baseminor, unsigned count,
+                        const char *name)
+{
+    (void)name;
+    *dev = MKDEV(CHRDEV_MAJOR, next_minor + baseminor);
+    next_minor += baseminor + count;
+    return 0;
+}
+
+void unregister_chrdev_region(dev_t dev, unsigned count)
+{
+    (void)dev;
+    (void)count;
+}
+
+void cdev_init(struct cdev *cdev, const struct file_operations *fops)
+{
+    memset(cdev, 0, sizeof(*cdev));
+    cdev->ops = fops;
+}
+
+int cdev_add(struct cdev *cdev, dev_t dev, unsigned count)
+{
+    if(nr_cdevs == NR_CDEVS) return -ENOMEM;
+    cdev->dev = dev;
+    cdev->count = count;
+    cdevs[nr_cdevs++] = cdev;
+    return 0;
+}
+
+void cdev_del(struct cdev *cdev)
+{
+    int i;
+    for(i=0; i<nr_cdevs; i++){
+        if(cdevs[i] == cdev){
+            cdevs[i] = cdevs[--nr_cdevs];
+            break;
+        }
+    }
+}
+
+
+struct file *eventfd_fget(int fd)
+{
+    struct file *file;
+
+    if(fd < 0 || fcntl(fd, F_GETFD) < 0) return ERR_PTR(-EBADF);
+    file = calloc(1, sizeof(*file));
+    if(!file) return ERR_PTR(-ENOMEM);
+    file->kshim_fd = fd;
+    return file;
+}
+
+int eventfd_signal(struct file *file, int n)
+{
+    u64 val = n;
+    return write(file->kshim_fd, &val, sizeof(val)) == sizeof(val) ? n : 0;
+}
+
+void fput(struct file *file)
+{
+    free(file);
+}
+
+
+/************* splice **************/
+
+static void *pipe_map(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
+                      int atomic)
+{
+    (void)pipe;
+    (void)atomic;
+    return buf->page;
+}
+
+static void pipe_unmap(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
+                       void *data)
+{
+    (void)pipe;
+    (void)buf;
+    (void)data;
+}
+
+static int pipe_confirm(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+    (void)pipe;
+    (void)buf;
+    return 0;
+}
+
+static const struct pipe_buf_operations pipe_ops = {
+    .map = pipe_map,
+    .unmap = pipe_unmap,
+    .confirm = pipe_confirm,
+};
+
+void kshim_pipe_push(struct pipe_inode_info *pipe, void *data, unsigned len)
+{
+    struct pipe_buffer *buf;
+
+    if(pipe->nrbufs == KSHIM_PIPE_BUFFERS) return;
+    buf = &pipe->bufs[(pipe->curbuf + pipe->nrbufs) % KSHIM_PIPE_BUFFERS];
+    buf->page = data;
+    buf->offset = 0;
+    buf->len = len;
+    buf->ops = &pipe_ops;
+    pipe->nrbufs++;
+}
+
+ssize_t splice_from_pipe(struct pipe_inode_info *pipe, struct file *out,
+                         loff_t *ppos, size_t len, unsigned int flags,
+                         splice_actor *actor)
+{
+    struct splice_desc sd = {
+        .total_len = len,
+        .flags = flags,
+        .u.file = out,
+    };
+    struct pipe_buffer *buf;
+    int ret = 0;
+
+    (void)ppos;
+    while(pipe->nrbufs && sd.total_len){
+        buf = &pipe->bufs[pipe->curbuf];
+        sd.len = min(buf->len, sd.total_len);
+        ret = actor(pipe, buf, &sd);
+        if(ret <= 0) break;
+        buf->offset += ret;
+        buf->len -= ret;
+        sd.num_spliced += ret;
+        sd.total_len -= ret;
+        if(!buf->len){
+            pipe->curbuf = (pipe->curbuf + 1) % KSHIM_PIPE_BUFFERS;
+            pipe->nrbufs--;
+        }
+    }
+    return sd.num_spliced ? (ssize_t)sd.num_spliced : ret;
+}
+
+
+/************* the host side **************/
+
+int kshim_bind(void)
+{
+    if(!kshim_driver) return -ENODEV;
+    return kshim_driver->bind(kshim_gadget);
+}
+
+void kshim_unbind(void)
+{
+    int i;
+
+    if(kshim_driver->disconnect)
+        kshim_driver->disconnect(kshim_gadget);
+    kshim_driver->unbind(kshim_gadget);
+    for(i=1; i<NR_EPS; i++)
+        eps[i].enabled = 0;
+    nr_cdevs = 0;
+    next_minor = 0;
+}
+
+/* the cable is pulled, the driver stays bound */
+void kshim_disconnect(void)
+{
+    if(kshim_driver->disconnect)
+        kshim_driver->disconnect(kshim_gadget);
+}
+
+struct usb_ep *kshim_ep(int n)
+{
+    return (n >= 0 && n < NR_EPS) ? &eps[n] : NULL;
+}
+
+/* 
+ * returns the length of the IN data stage, or the error from setup().
+ * for an OUT request, data is what the host sends in the data stage.
+ */
+int kshim_host_setup(const struct usb_ctrlrequest *ctrl, void *data, int len)
+{
+    int ret;
+
+    ep0_len = 0;
+    if(!(ctrl->bRequestType & USB_DIR_IN) && ctrl->wLength){
+        ep0_out = data;
+        ep0_out_len = len;
+        data = NULL;
+    }
+    ret = kshim_driver->setup(kshim_gadget, ctrl);
+    ep0_out = NULL;
+    if(ret < 0) return ret;
+    if(data) memcpy(data, ep0_buf, min(len, ep0_len));
+    return ep0_len;
+}
+
+/* take the oldest report queued on ep, as the host would on a poll */
+int kshim_host_poll(struct usb_ep *ep, void *data, int len)
+{
+    struct usb_request *req;
+    pthread_mutex_t *m = &ep_mutex[ep_index(ep)];
+
+    pthread_mutex_lock(m);
+    if(list_empty(&ep->queue)){
+        pthread_mutex_unlock(m);
+        return -EAGAIN;
+    }
+    req = list_entry(ep->queue.next, struct usb_request, list);
+    list_del(&req->list);
+    ep->nr_queued--;
+    pthread_mutex_unlock(m);
+
+    len = min(len, (int)req->length);
+    if(data) memcpy(data, req->buf, len);
+    req->status = 0;
+    req->actual = req->length;
+    req->complete(ep, req);
+    return len;
+}
+
+int kshim_open(unsigned minor, struct file *file)
+{
+    static struct inode inodes[NR_CDEVS];
+    struct cdev *cdev;
+    int i;
+
+    for(i=0; i<nr_cdevs; i++){
+        cdev = cdevs[i];
+        if(minor >= MINOR(cdev->dev) && minor < MINOR(cdev->dev) + cdev->count){
+            inodes[i].i_cdev = cdev;
+            inodes[i].i_rdev = MKDEV(MAJOR(cdev->dev), minor);
+            memset(file, 0, sizeof(*file));
+            file->f_op = cdev->ops;
+            return cdev->ops->open(&inodes[i], file);
+        }
+    }
+    return -ENODEV;
+}
+
+int kshim_close(unsigned minor, struct file *file)
+{
+    struct inode inode;
+    int i;
+
+    for(i=0; i<nr_cdevs; i++){
+        if(minor >= MINOR(cdevs[i]->dev)
+           && minor < MINOR(cdevs[i]->dev) + cdevs[i]->count){
+            inode.i_cdev = cdevs[i];
+            inode.i_rdev = MKDEV(MAJOR(cdevs[i]->dev), minor);
+            return cdevs[i]->ops->release(&inode, file);
+        }
+    }
+    return -ENODEV;
+}
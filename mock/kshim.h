@@ -0,0 +1,437 @@
+/*
+ * =======================================================================
+ *
+ *       Filename:  kshim.h
+ *
+ *    Description:  userspace stand-ins for the kernel APIs used by 
+ *                  omimic.c, so that the driver can be built and 
+ *                  exercised against a mock UDC (see kshim.c).
+ *
+ *        Version:  0.1
+ *       Compiler:  gcc
+ *
+ *         Author:  Kay Zheng (l_amee), l04m33@gmail.com
+ *
+ * =======================================================================
+ */
+
+#ifndef KSHIM_H
+#define KSHIM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <linux/types.h>
+
+
+typedef __u8 u8;
+typedef __u16 u16;
+typedef __u32 u32;
+typedef __u64 u64;
+typedef __s8 s8;
+typedef __s16 s16;
+typedef __s32 s32;
+typedef __s64 s64;
+typedef unsigned int gfp_t;
+
+#define __user
+#define __init
+#define __exit
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 1
+
+#define KERN_DEBUG ""
+#define KERN_NOTICE ""
+#define KERN_INFO ""
+#define KERN_ERR ""
+extern int kshim_verbose;
+#define printk(fmt, args...) \
+    do { if(kshim_verbose) fprintf(stderr, fmt, ## args); } while(0)
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b) ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b) ((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define clamp_t(t, v, lo, hi) min_t(t, max_t(t, v, lo), hi)
+#define BUILD_BUG_ON(c) ((void)sizeof(char[1 - 2 * !!(c)]))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define __constant_cpu_to_le16(x) ((__le16)(x))
+#else
+#define __constant_cpu_to_le16(x) ((__le16)__builtin_bswap16(x))
+#endif
+#define cpu_to_le16(x) htole16(x)
+#define le16_to_cpu(x) le16toh(x)
+
+#define S_IRUGO 0444
+#ifndef S_IWUSR  /* <fcntl.h> may have it */
+#define S_IWUSR 0200
+#endif
+
+
+/************* memory **************/
+
+#define L1_CACHE_BYTES 64
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
+#define L1_CACHE_ALIGN(x) ALIGN(x, L1_CACHE_BYTES)
+
+static inline void *kmalloc(size_t size, gfp_t flags)
+{
+    void *p;
+    (void)flags;
+    return posix_memalign(&p, L1_CACHE_BYTES, size) ? NULL : p;
+}
+
+static inline void *kzalloc(size_t size, gfp_t flags)
+{
+    void *p = kmalloc(size, flags);
+    if(p) memset(p, 0, size);
+    return p;
+}
+
+#define kfree(p) free((void *)(p))
+
+#define copy_from_user(to, from, n) (memcpy((to), (from), (n)), 0UL)
+#define get_user(x, p) ((x) = *(p), 0)
+#define copy_to_user(to, from, n) (memcpy((to), (from), (n)), 0UL)
+
+#define ERR_PTR(e) ((void *)(long)(e))
+#define PTR_ERR(p) ((long)(p))
+#define IS_ERR(p) ((unsigned long)(p) >= (unsigned long)-4095)
+
+
+/************* modules **************/
+
+struct module;
+#define THIS_MODULE NULL
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_PARM_DESC(name, desc)
+
+/* parameters can be changed from the harness with kshim_set_param() */
+extern void kshim_register_param(const char *, int *);
+#define module_param(name, type, perm) \
+    static void __attribute__((constructor)) kshim_param_##name(void) \
+    { kshim_register_param(#name, (int *)&name); }
+
+extern int (*kshim_module_init)(void);
+extern void (*kshim_module_exit)(void);
+#define module_init(fn) int (*kshim_module_init)(void) = fn
+#define module_exit(fn) void (*kshim_module_exit)(void) = fn
+
+
+/************* locking **************/
+
+typedef struct { pthread_spinlock_t l; } spinlock_t;
+#define spin_lock_init(s) pthread_spin_init(&(s)->l, 0)
+#define spin_lock(s) pthread_spin_lock(&(s)->l)
+#define spin_unlock(s) pthread_spin_unlock(&(s)->l)
+#define spin_lock_irqsave(s, f) do { (f) = 0; spin_lock(s); } while(0)
+#define spin_unlock_irqrestore(s, f) do { (void)(f); spin_unlock(s); } while(0)
+#define spin_lock_irq(s) spin_lock(s)
+#define spin_unlock_irq(s) spin_unlock(s)
+
+typedef struct { int counter; } atomic_t;
+#define atomic_read(v) __sync_fetch_and_add(&(v)->counter, 0)
+#define atomic_inc(v) ((void)__sync_fetch_and_add(&(v)->counter, 1))
+#define atomic_dec(v) ((void)__sync_fetch_and_sub(&(v)->counter, 1))
+
+struct mutex { pthread_mutex_t m; };
+#define mutex_init(x) pthread_mutex_init(&(x)->m, NULL)
+#define mutex_lock(x) pthread_mutex_lock(&(x)->m)
+#define mutex_unlock(x) pthread_mutex_unlock(&(x)->m)
+
+
+/************* lists & bitmaps **************/
+
+struct list_head { struct list_head *next, *prev; };
+
+#define INIT_LIST_HEAD(h) do { (h)->next = (h); (h)->prev = (h); } while(0)
+
+static inline void __list_add(struct list_head *n, struct list_head *prev,
+                              struct list_head *next)
+{
+    next->prev = n;
+    n->next = next;
+    n->prev = prev;
+    prev->next = n;
+}
+
+static inline void list_add(struct list_head *n, struct list_head *h)
+{ __list_add(n, h, h->next); }
+static inline void list_add_tail(struct list_head *n, struct list_head *h)
+{ __list_add(n, h->prev, h); }
+
+static inline void list_del(struct list_head *e)
+{
+    e->next->prev = e->prev;
+    e->prev->next = e->next;
+    e->next = e->prev = NULL;
+}
+
+static inline int list_empty(const struct list_head *h)
+{ return h->next == h; }
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_for_each_entry(pos, head, member) \
+    for(pos = list_entry((head)->next, typeof(*pos), member); \
+        &pos->member != (head); \
+        pos = list_entry(pos->member.next, typeof(*pos), member))
+#define list_for_each_entry_safe(pos, n, head, member) \
+    for(pos = list_entry((head)->next, typeof(*pos), member), \
+        n = list_entry(pos->member.next, typeof(*pos), member); \
+        &pos->member != (head); \
+        pos = n, n = list_entry(n->member.next, typeof(*n), member))
+
+#define BITS_PER_LONG (8 * sizeof(long))
+#define BITS_TO_LONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define DECLARE_BITMAP(name, bits) unsigned long name[BITS_TO_LONGS(bits)]
+static inline int test_bit(int nr, const unsigned long *a)
+{ return (a[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1; }
+static inline void __set_bit(int nr, unsigned long *a)
+{ a[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG); }
+static inline void __clear_bit(int nr, unsigned long *a)
+{ a[nr / BITS_PER_LONG] &= ~(1UL << (nr % BITS_PER_LONG)); }
+static inline void set_bit(int nr, unsigned long *a)
+{ __sync_fetch_and_or(&a[nr / BITS_PER_LONG], 1UL << (nr % BITS_PER_LONG)); }
+static inline void clear_bit(int nr, unsigned long *a)
+{ __sync_fetch_and_and(&a[nr / BITS_PER_LONG], ~(1UL << (nr % BITS_PER_LONG))); }
+static inline int test_and_clear_bit(int nr, unsigned long *a)
+{
+    unsigned long m = 1UL << (nr % BITS_PER_LONG);
+    return (__sync_fetch_and_and(&a[nr / BITS_PER_LONG], ~m) & m) != 0;
+}
+#define bitmap_zero(a, bits) \
+    memset((a), 0, BITS_TO_LONGS(bits) * sizeof(long))
+
+
+/************* timers **************/
+
+/* 
+ * timers never fire by themselves: jiffies follow the virtual clock 
+ * (kshim_clock_ns, see below), kshim_run_timers() fires the expired ones.
+ */
+extern s64 kshim_clock_ns;
+#define HZ 1000
+#define jiffies ((unsigned long)(kshim_clock_ns / (1000000000 / HZ)))
+#define msecs_to_jiffies(m) ((unsigned long)(m))
+
+struct timer_list {
+    unsigned long expires;
+    void (*function)(unsigned long);
+    unsigned long data;
+    int pending;
+};
+
+extern void setup_timer(struct timer_list *, void (*)(unsigned long), 
+                        unsigned long);
+extern int mod_timer(struct timer_list *, unsigned long);
+extern int del_timer_sync(struct timer_list *);
+extern void kshim_run_timers(void);
+
+
+/* 
+ * hrtimers run on a virtual clock, which only moves when the harness
+ * sets kshim_clock_ns. kshim_run_hrtimers() fires the expired ones.
+ */
+
+typedef struct { s64 tv64; } ktime_t;
+
+static inline ktime_t ktime_get(void)
+{ ktime_t t = { kshim_clock_ns }; return t; }
+static inline ktime_t ns_to_ktime(s64 ns)
+{ ktime_t t = { ns }; return t; }
+static inline ktime_t ktime_add_ns(ktime_t t, u64 ns)
+{ t.tv64 += ns; return t; }
+static inline ktime_t ktime_sub(ktime_t a, ktime_t b)
+{ a.tv64 -= b.tv64; return a; }
+#define ktime_to_ns(t) ((t).tv64)
+
+static inline s64 div_s64(s64 dividend, s32 divisor)
+{ return dividend / divisor; }
+
+enum hrtimer_mode { HRTIMER_MODE_ABS, HRTIMER_MODE_REL };
+enum hrtimer_restart { HRTIMER_NORESTART, HRTIMER_RESTART };
+
+struct hrtimer {
+    enum hrtimer_restart (*function)(struct hrtimer *);
+    ktime_t expires;
+    int active;
+};
+
+extern void hrtimer_init(struct hrtimer *, clockid_t, enum hrtimer_mode);
+extern int hrtimer_start(struct hrtimer *, ktime_t, enum hrtimer_mode);
+extern int hrtimer_try_to_cancel(struct hrtimer *);
+extern int hrtimer_cancel(struct hrtimer *);
+#define hrtimer_active(t) ((t)->active)
+extern void kshim_run_hrtimers(void);
+
+
+/************* wait queues & poll **************/
+
+/* the harness never sleeps in the driver, waiters just spin */
+#define ERESTARTSYS 512
+
+typedef struct { int unused; } wait_queue_head_t;
+#define init_waitqueue_head(q) ((void)(q))
+#define wake_up_interruptible(q) ((void)(q))
+#define wait_event_interruptible(q, cond) \
+    ({ (void)(q); while(!(cond)) sched_yield(); 0; })
+
+typedef struct poll_table_struct { int unused; } poll_table;
+#define poll_wait(f, q, p) ((void)(f), (void)(q), (void)(p))
+
+
+/************* char devices **************/
+
+#define MAJOR(d) ((unsigned int)((d) >> 20))
+#define MINOR(d) ((unsigned int)((d) & 0xfffff))
+#define MKDEV(ma, mi) (((ma) << 20) | (mi))
+
+struct class { const char *name; };
+extern struct class input_class;
+
+struct device {
+    char bus_id[20];
+    dev_t devt;
+    struct class *class;
+    struct device *parent;
+    void (*release)(struct device *);
+    void *driver_data;
+};
+
+static inline void device_initialize(struct device *d) { (void)d; }
+static inline int device_add(struct device *d) { (void)d; return 0; }
+static inline void device_del(struct device *d) { (void)d; }
+
+struct file;
+struct inode;
+struct pipe_inode_info;
+struct poll_table_struct;
+
+struct file_operations {
+    struct module *owner;
+    int (*open)(struct inode *, struct file *);
+    int (*release)(struct inode *, struct file *);
+    ssize_t (*read)(struct file *, char __user *, size_t, loff_t *);
+    ssize_t (*write)(struct file *, const char __user *, size_t, loff_t *);
+    long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+    ssize_t (*splice_write)(struct pipe_inode_info *, struct file *,
+                            loff_t *, size_t, unsigned int);
+    unsigned int (*poll)(struct file *, struct poll_table_struct *);
+};
+
+struct cdev {
+    struct module *owner;
+    const struct file_operations *ops;
+    dev_t dev;
+    unsigned count;
+};
+
+extern void cdev_init(struct cdev *, const struct file_operations *);
+extern int cdev_add(struct cdev *, dev_t, unsigned);
+extern void cdev_del(struct cdev *);
+extern int alloc_chrdev_region(dev_t *, unsigned, unsigned, const char *);
+extern void unregister_chrdev_region(dev_t, unsigned);
+
+struct inode {
+    struct cdev *i_cdev;
+    dev_t i_rdev;
+};
+#define iminor(i) MINOR((i)->i_rdev)
+
+struct file {
+    const struct file_operations *f_op;
+    void *private_data;
+    unsigned int f_flags;
+    loff_t f_pos;
+    int kshim_fd;  /* the real eventfd behind an eventfd_fget() file */
+};
+
+/* eventfds are real ones, signaled with write(2) */
+extern struct file *eventfd_fget(int);
+extern int eventfd_signal(struct file *, int);
+extern void fput(struct file *);
+
+
+/************* pipes & splice **************/
+
+struct pipe_buffer;
+
+struct pipe_buf_operations {
+    int can_merge;
+    void *(*map)(struct pipe_inode_info *, struct pipe_buffer *, int);
+    void (*unmap)(struct pipe_inode_info *, struct pipe_buffer *, void *);
+    int (*confirm)(struct pipe_inode_info *, struct pipe_buffer *);
+};
+
+struct pipe_buffer {
+    void *page;
+    unsigned int offset, len;
+    const struct pipe_buf_operations *ops;
+    unsigned int flags;
+};
+
+/* a pipe is just a ring of buffers here */
+#define KSHIM_PIPE_BUFFERS 16
+struct pipe_inode_info {
+    struct pipe_buffer bufs[KSHIM_PIPE_BUFFERS];
+    unsigned int nrbufs, curbuf;
+};
+
+struct splice_desc {
+    unsigned int len, total_len;
+    unsigned int flags;
+    union {
+        void __user *userptr;
+        struct file *file;
+        void *data;
+    } u;
+    loff_t pos;
+    size_t num_spliced;
+};
+
+typedef int (splice_actor)(struct pipe_inode_info *, struct pipe_buffer *,
+                           struct splice_desc *);
+extern ssize_t splice_from_pipe(struct pipe_inode_info *, struct file *,
+                                loff_t *, size_t, unsigned int,
+                                splice_actor *);
+
+
+/************* the mock UDC, for the harness **************/
+
+struct usb_gadget;
+struct usb_ep;
+struct usb_ctrlrequest;
+
+extern struct usb_gadget *kshim_gadget;
+extern struct usb_gadget_driver *kshim_driver;
+
+extern int kshim_set_param(const char *, int);
+extern int kshim_bind(void);
+extern void kshim_unbind(void);
+extern void kshim_disconnect(void);
+extern struct usb_ep *kshim_ep(int);
+extern int kshim_host_setup(const struct usb_ctrlrequest *, void *, int);
+extern int kshim_host_poll(struct usb_ep *, void *, int);
+extern int kshim_open(unsigned, struct file *);
+extern int kshim_close(unsigned, struct file *);
+extern void kshim_pipe_push(struct pipe_inode_info *, void *, unsigned);
+
+#endif
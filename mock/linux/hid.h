@@ -0,0 +1,21 @@
+#include <kshim.h>
+#include_next <linux/hid.h>
+
+#ifndef KSHIM_HID_H
+#define KSHIM_HID_H
+
+struct hid_class_descriptor {
+    __u8   bDescriptorType;
+    __le16 wDescriptorLength;
+} __attribute__ ((packed));
+
+struct hid_descriptor {
+    __u8   bLength;
+    __u8   bDescriptorType;
+    __le16 bcdHID;
+    __u8   bCountryCode;
+    __u8   bNumDescriptors;
+    struct hid_class_descriptor desc[1];
+} __attribute__ ((packed));
+
+#endif
@@ -0,0 +1,2 @@
+#include <kshim.h>
+#include_next <linux/ioctl.h>
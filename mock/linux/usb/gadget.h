@@ -0,0 +1,91 @@
+#include <kshim.h>
+#include <linux/usb/ch9.h>
+
+#ifndef KSHIM_GADGET_H
+#define KSHIM_GADGET_H
+
+struct usb_ep;
+
+struct usb_request {
+    void *buf;
+    unsigned length;
+    unsigned no_interrupt:1;
+    unsigned zero:1;
+    unsigned short_not_ok:1;
+    void (*complete)(struct usb_ep *, struct usb_request *);
+    void *context;
+    struct list_head list;
+    int status;
+    unsigned actual;
+};
+
+struct usb_ep {
+    void *driver_data;
+    const char *name;
+    unsigned maxpacket:16;
+
+    /* mock UDC state */
+    int claimed;
+    int enabled;
+    const struct usb_endpoint_descriptor *desc;
+    struct list_head queue;   /* requests waiting for a host poll */
+    unsigned long nr_queued;
+};
+
+struct usb_gadget {
+    struct usb_ep *ep0;
+    enum usb_device_speed speed;
+    unsigned is_dualspeed:1;
+    unsigned is_otg:1;
+    const char *name;
+    void *driver_data;
+};
+
+static inline void set_gadget_data(struct usb_gadget *g, void *data)
+{ g->driver_data = data; }
+static inline void *get_gadget_data(struct usb_gadget *g)
+{ return g->driver_data; }
+
+struct usb_gadget_driver {
+    char *function;
+    enum usb_device_speed speed;
+    int (*bind)(struct usb_gadget *);
+    void (*unbind)(struct usb_gadget *);
+    int (*setup)(struct usb_gadget *, const struct usb_ctrlrequest *);
+    void (*disconnect)(struct usb_gadget *);
+    void (*suspend)(struct usb_gadget *);
+    void (*resume)(struct usb_gadget *);
+    struct { const char *name; } driver;
+};
+
+struct usb_string {
+    u8 id;
+    const char *s;
+};
+
+struct usb_gadget_strings {
+    u16 language;
+    struct usb_string *strings;
+};
+
+extern int usb_ep_enable(struct usb_ep *, 
+                         const struct usb_endpoint_descriptor *);
+extern int usb_ep_disable(struct usb_ep *);
+extern struct usb_request *usb_ep_alloc_request(struct usb_ep *, gfp_t);
+extern void usb_ep_free_request(struct usb_ep *, struct usb_request *);
+extern int usb_ep_queue(struct usb_ep *, struct usb_request *, gfp_t);
+extern int usb_ep_dequeue(struct usb_ep *, struct usb_request *);
+extern int usb_gadget_frame_number(struct usb_gadget *);
+extern int usb_gadget_wakeup(struct usb_gadget *);
+extern int usb_gadget_set_selfpowered(struct usb_gadget *);
+extern int usb_gadget_register_driver(struct usb_gadget_driver *);
+extern int usb_gadget_unregister_driver(struct usb_gadget_driver *);
+extern int usb_gadget_get_string(struct usb_gadget_strings *, int, u8 *);
+extern int usb_gadget_config_buf(const struct usb_config_descriptor *, 
+                                 void *, unsigned, 
+                                 const struct usb_descriptor_header **);
+extern struct usb_ep *usb_ep_autoconfig(struct usb_gadget *,
+                                        struct usb_endpoint_descriptor *);
+extern void usb_ep_autoconfig_reset(struct usb_gadget *);
+
+#endif
@@ -0,0 +1,854 @@
+/*
+ * =======================================================================
+ *
+ *       Filename:  omimic_bench.c
+ *
+ *    Description:  microbenchmarks for the omimic hot paths, run on the
+ *                  mock UDC in kshim.c, no hardware needed.
+ *
+ *                  usage: omimic_bench [-n iterations] [-t threads]
+ *                                      [-v] [bench ...]
+ *
+ *        Version:  0.1
+ *       Compiler:  gcc
+ *
+ *         Author:  Kay Zheng (l_amee), l04m33@gmail.com
+ *
+ * =======================================================================
+ */
+
+#include <linux/kernel.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/gadget.h>
+#include <linux/fs.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#include "../omimic.h"
+
+
+#define KBD_BUFSIZE 8
+#define MOUSE_BUFSIZE 4
+#define KM_CONF_VAL 2
+#define EVENT_BATCH 64
+#define SPLICE_CHUNK 4092   /* reports span two pipe buffers */
+#define BURST 32
+#define EP0_BUF 256
+#define FRAME_NS 1000000
+#define MOVES_PER_FRAME 8
+#define POOL_MIN 2          /* the driver defaults */
+#define POOL_IDLE_MS 1000
+
+
+struct bench {
+    const char *name;
+    void (*run)(void);
+};
+
+static unsigned long nr_iter = 1000000;
+static int nr_threads = 4;
+static struct file file;             /* /dev/omimic */
+static struct file kbd_file, mouse_file, pad_file;  /* per-endpoint */
+
+/* endpoints in the order omimic_bind() claims them */
+static struct usb_ep *kbd_ep, *mouse_ep, *pad_ep;
+
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, unsigned long ops, double ns)
+{
+    printf("%-36s %10lu ops %10.1f ns/op %12.0f ops/s\n",
+           name, ops, ops ? ns / ops : 0.0, ns > 0 ? ops * 1e9 / ns : 0.0);
+}
+
+static void set_config(int config)
+{
+    struct usb_ctrlrequest ctrl = {
+        .bRequestType = 0,
+        .bRequest = USB_REQ_SET_CONFIGURATION,
+        .wValue = cpu_to_le16(config),
+    };
+    kshim_host_setup(&ctrl, NULL, 0);
+}
+
+/* bind the driver, configure it and open the char device */
+static void gadget_up(void)
+{
+    if(kshim_bind()){
+        fprintf(stderr, "bind failed, abort.\n");
+        exit(1);
+    }
+    set_config(KM_CONF_VAL);
+    kbd_ep = kshim_ep(1);
+    mouse_ep = kshim_ep(2);
+    pad_ep = kshim_ep(3);
+    if(kshim_open(0, &file) || kshim_open(1, &kbd_file) 
+       || kshim_open(2, &mouse_file)){
+        fprintf(stderr, "open failed, abort.\n");
+        exit(1);
+    }
+    /* only there with the gamepad parameter */
+    kshim_open(3, &pad_file);
+}
+
+static void gadget_down(void)
+{
+    kshim_close(0, &file);
+    kshim_close(1, &kbd_file);
+    kshim_close(2, &mouse_file);
+    if(pad_file.private_data) kshim_close(3, &pad_file);
+    kshim_unbind();
+}
+
+static ssize_t dev_write(const void *buf, size_t count)
+{
+    loff_t pos = 0;
+    return file.f_op->write(&file, buf, count, &pos);
+}
+
+static int drain(struct usb_ep *ep)
+{
+    int n = 0;
+    while(kshim_host_poll(ep, NULL, 0) >= 0) n++;
+    return n;
+}
+
+
+/************* benchmarks **************/
+
+/* the GET_DESCRIPTOR requests of an enumeration, over and over */
+static void bench_enum(void)
+{
+    static const u16 descs[][2] = {
+        { USB_DT_DEVICE << 8, 0 },
+        { USB_DT_CONFIG << 8, 0 },
+        { USB_DT_STRING << 8, 0 },
+        { (USB_DT_STRING << 8) | 11, 0x0409 },
+        { (USB_DT_STRING << 8) | 249, 0x0409 },
+        { USB_DT_CS_CONFIG << 8, 0 },
+        { USB_DT_CS_CONFIG << 8, 1 },
+    };
+    struct usb_ctrlrequest ctrl = {
+        .bRequestType = USB_DIR_IN,
+        .bRequest = USB_REQ_GET_DESCRIPTOR,
+        .wLength = cpu_to_le16(EP0_BUF),
+    };
+    static u8 buf[EP0_BUF];
+    unsigned long i, bytes = 0;
+    double t;
+    int j, ret;
+
+    gadget_up();
+    /* no gamepad unless asked for */
+    ctrl.wValue = cpu_to_le16(USB_DT_CONFIG << 8);
+    ret = kshim_host_setup(&ctrl, buf, sizeof(buf));
+    if(ret <= 4 || buf[4] != 2)
+        fprintf(stderr, "config: %d bytes, %d interfaces\n", 
+                ret, ret > 4 ? buf[4] : 0);
+    t = now_ns();
+    for(i=0; i<nr_iter; i++){
+        j = i % ARRAY_SIZE(descs);
+        ctrl.wValue = cpu_to_le16(descs[j][0]);
+        ctrl.wIndex = cpu_to_le16(descs[j][1]);
+        ret = kshim_host_setup(&ctrl, buf, sizeof(buf));
+        if(ret <= 0){
+            fprintf(stderr, "GET_DESCRIPTOR %04x failed: %d\n", 
+                    descs[j][0], ret);
+            break;
+        }
+        bytes += ret;
+    }
+    report("GET_DESCRIPTOR", i, now_ns() - t);
+    printf("%-36s %10lu bytes\n", "", bytes);
+    gadget_down();
+}
+
+/* SET_REPORT from the host, read back on the kbd node */
+static void bench_leds(void)
+{
+    struct usb_ctrlrequest ctrl = {
+        .bRequestType = USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+        .bRequest = 0x09,  /* SET_REPORT */
+        .wValue = cpu_to_le16(0x0200),  /* output report */
+        .wIndex = cpu_to_le16(0),
+        .wLength = cpu_to_le16(1),
+    };
+    unsigned long i, lost = 0;
+    loff_t pos;
+    u8 leds, got;
+    double t;
+
+    gadget_up();
+    kbd_file.f_flags |= O_NONBLOCK;
+    t = now_ns();
+    for(i=0; i<nr_iter; i++){
+        leds = i & (OMIMIC_LED_NUM_LOCK | OMIMIC_LED_CAPS_LOCK);
+        kshim_host_setup(&ctrl, &leds, 1);
+        if(!(kbd_file.f_op->poll(&kbd_file, NULL) & POLLIN))
+            lost++;
+        pos = kbd_file.f_pos;
+        if(kbd_file.f_op->read(&kbd_file, (void *)&got, 1, &pos) != 1 
+           || got != leds)
+            lost++;
+        kbd_file.f_pos = pos;
+    }
+    report("SET_REPORT->read kbd", i, now_ns() - t);
+    printf("%-36s %10lu lost\n", "", lost);
+    gadget_down();
+}
+
+/* one report written and polled at a time, the plain hot path */
+static void bench_write(void)
+{
+    u8 kbd[KBD_BUFSIZE] = { 0 };
+    u8 mouse[MOUSE_BUFSIZE] = { 0, 1, 1, 0 };
+    unsigned long i;
+    double t;
+
+    gadget_up();
+    t = now_ns();
+    for(i=0; i<nr_iter; i++){
+        kbd[2] = 0x04 + (i & 0x1f);
+        dev_write(kbd, KBD_BUFSIZE);
+        kshim_host_poll(kbd_ep, NULL, 0);
+    }
+    report("write->complete kbd", nr_iter, now_ns() - t);
+
+    t = now_ns();
+    for(i=0; i<nr_iter; i++){
+        dev_write(mouse, MOUSE_BUFSIZE);
+        kshim_host_poll(mouse_ep, NULL, 0);
+    }
+    report("write->complete mouse", nr_iter, now_ns() - t);
+    gadget_down();
+}
+
+/* fill the pool until -EBUSY, then let the host drain it */
+static void bench_burst(void)
+{
+    u8 kbd[KBD_BUFSIZE] = { 0 };
+    unsigned long done = 0, busy = 0, bad = 0;
+    double t, t_busy = 0, t0;
+
+    gadget_up();
+    t = now_ns();
+    while(done < nr_iter){
+        while(dev_write(kbd, KBD_BUFSIZE) == KBD_BUFSIZE) done++;
+        /* poll() tells the -EBUSY ahead */
+        if(file.f_op->poll(&file, NULL) & POLLOUT) bad++;
+        t0 = now_ns();
+        dev_write(kbd, KBD_BUFSIZE);
+        t_busy += now_ns() - t0;
+        busy++;
+        drain(kbd_ep);
+        if(!(file.f_op->poll(&file, NULL) & POLLOUT)) bad++;
+    }
+    report("burst write+drain kbd", done, now_ns() - t);
+    report("  -EBUSY write", busy, t_busy);
+    printf("%-36s %10lu bad polls%s\n", "", bad, bad ? " (BAD)" : "");
+    gadget_down();
+}
+
+/* bursts of BURST writes, each followed by BURST host polls */
+static void exhaust(const char *name, int adaptive)
+{
+    u8 kbd[KBD_BUFSIZE] = { 0 };
+    unsigned long i, busy = 0;
+    double t;
+    int j;
+
+    kshim_set_param("pool_adaptive", adaptive);
+    gadget_up();
+    t = now_ns();
+    for(i=0; i<nr_iter; i+=BURST){
+        for(j=0; j<BURST; j++)
+            if(dev_write(kbd, KBD_BUFSIZE) < 0) busy++;
+        for(j=0; j<BURST; j++)
+            kshim_host_poll(kbd_ep, NULL, 0);
+    }
+    report(name, i, now_ns() - t);
+    printf("%-36s %10lu -EBUSY (%.2f%%)\n", "", busy, 100.0 * busy / nr_iter);
+    drain(kbd_ep);
+    gadget_down();
+    kshim_set_param("pool_adaptive", 0);
+}
+
+static void bench_exhaust(void)
+{
+    exhaust("pool exhaustion, fixed", 0);
+    exhaust("pool exhaustion, adaptive", 1);
+}
+
+/* 
+ * the adaptive pool grows under a burst, then the host goes quiet for 
+ * a few pool_idle_ms periods on the virtual clock. the pool timer must 
+ * bring the depth back to pool_min, freeing only idle requests: the 
+ * ones still in flight complete afterwards.
+ */
+#define SHRINK_MIN 4
+#define SHRINK_IN_FLIGHT 2
+#define SHRINK_IDLE_MS 100
+
+static void bench_shrink(void)
+{
+    struct omimic_queue_stats stats;
+    struct omimic_ep_stats *st = &stats.ep[OMIMIC_EP_KBD];
+    u8 kbd[KBD_BUFSIZE] = { 0 };
+    unsigned long i, n = nr_iter / 100 ? nr_iter / 100 : 1;
+    unsigned long grown = 0, bad = 0;
+    double t;
+    int j;
+
+    kshim_set_param("pool_adaptive", 1);
+    kshim_set_param("pool_min", SHRINK_MIN);
+    kshim_set_param("pool_idle_ms", SHRINK_IDLE_MS);
+    kshim_clock_ns = 0;
+    gadget_up();
+    t = now_ns();
+    for(i=0; i<n; i++){
+        for(j=0; j<BURST; j++)
+            if(dev_write(kbd, KBD_BUFSIZE) < 0) break;
+        for(j=0; j<BURST - SHRINK_IN_FLIGHT; j++)
+            kshim_host_poll(kbd_ep, NULL, 0);
+        file.f_op->unlocked_ioctl(&file, OMIMIC_IOC_QUEUE_STATS, 
+                                  (unsigned long)&stats);
+        grown += st->idle + st->busy;
+
+        /* halves the excess each period */
+        for(j=0; j<8; j++){
+            kshim_clock_ns += (SHRINK_IDLE_MS + 1) * 1000000LL;
+            kshim_run_timers();
+        }
+        file.f_op->unlocked_ioctl(&file, OMIMIC_IOC_QUEUE_STATS, 
+                                  (unsigned long)&stats);
+        if(st->idle + st->busy != SHRINK_MIN 
+           || st->busy != SHRINK_IN_FLIGHT 
+           || st->in_flight != SHRINK_IN_FLIGHT)
+            bad++;
+        if(drain(kbd_ep) != SHRINK_IN_FLIGHT) bad++;
+    }
+    report("pool grow->shrink", i, now_ns() - t);
+    printf("%-36s %10.1f grown depth, %lu bad cycles%s\n", "", 
+           (double)grown / n, bad, bad ? " (BAD)" : "");
+    gadget_down();
+    kshim_set_param("pool_idle_ms", POOL_IDLE_MS);
+    kshim_set_param("pool_min", POOL_MIN);
+    kshim_set_param("pool_adaptive", 0);
+}
+
+/* submit a batch, letting the host poll whenever the pool runs dry */
+static unsigned long submit_events(struct omimic_event *evs, int nr, 
+                                   struct usb_ep *ep)
+{
+    struct omimic_event_batch batch;
+    unsigned long reports = 0;
+    long ret;
+    int done = 0;
+
+    while(done < nr){
+        batch.nr = nr - done;
+        batch.events = (unsigned long)(evs + done);
+        ret = file.f_op->unlocked_ioctl(&file, OMIMIC_IOC_EVENTS,
+                                        (unsigned long)&batch);
+        if(ret > 0) done += ret;
+        reports += drain(ep);
+    }
+    return reports;
+}
+
+/* batches of events, collapsed by the driver between polls */
+static void events(const char *name, struct omimic_event *evs, 
+                   struct usb_ep **ep)
+{
+    unsigned long i, reports = 0;
+    double t;
+
+    gadget_up();
+    t = now_ns();
+    for(i=0; i<nr_iter; i+=EVENT_BATCH)
+        reports += submit_events(evs, EVENT_BATCH, *ep);
+    report(name, i, now_ns() - t);
+    printf("%-36s %10lu reports (%.3f per event)\n", "",
+           reports, i ? (double)reports / i : 0.0);
+    gadget_down();
+}
+
+static void bench_events(void)
+{
+    struct omimic_event evs[EVENT_BATCH];
+    int j;
+
+    /* typing: every key pressed and released */
+    for(j=0; j<EVENT_BATCH; j++){
+        evs[j].op = (j & 1) ? OMIMIC_EV_KEY_UP : OMIMIC_EV_KEY_DOWN;
+        evs[j].code = 0x04 + (j >> 1) % 26;
+        evs[j].value = 0;
+    }
+    events("event ioctl, key taps", evs, &kbd_ep);
+
+    /* chords: all keys down, then all up */
+    for(j=0; j<EVENT_BATCH; j++){
+        evs[j].op = (j < EVENT_BATCH/2) ? 
+            OMIMIC_EV_KEY_DOWN : OMIMIC_EV_KEY_UP;
+        evs[j].code = 0x04 + j % 6;
+    }
+    events("event ioctl, 6-key chords", evs, &kbd_ep);
+
+    /* pointer motion */
+    for(j=0; j<EVENT_BATCH; j++){
+        evs[j].op = OMIMIC_EV_MOUSE_MOVE;
+        evs[j].code = j & 1;
+        evs[j].value = 3;
+    }
+    events("event ioctl, mouse moves", evs, &mouse_ep);
+}
+
+/* 
+ * a test rig driving the gamepad: full reports on the gamepad node, 
+ * then stick sweeps and button taps through the event ioctl.
+ */
+static void bench_gamepad(void)
+{
+    u8 pad[OMIMIC_PAD_REPORT_SIZE] = { 0 };
+    struct omimic_event evs[EVENT_BATCH];
+    unsigned long i, bad = 0;
+    loff_t pos = 0;
+    double t;
+    int j;
+
+    kshim_set_param("gamepad", 1);
+    gadget_up();
+    if(pad_ep->desc->bInterval != 1)
+        fprintf(stderr, "gamepad bInterval: %d\n", pad_ep->desc->bInterval);
+    t = now_ns();
+    for(i=0; i<nr_iter; i++){
+        pad[0] = i & 0xff;
+        pad[2] = i & 7;
+        pad[3] = i >> 8;
+        pad_file.f_op->write(&pad_file, (void *)pad, sizeof(pad), &pos);
+        if(kshim_host_poll(pad_ep, NULL, 0) < 0) bad++;
+    }
+    report("write->complete gamepad", nr_iter, now_ns() - t);
+    if(bad) printf("%-36s %10lu lost\n", "", bad);
+    gadget_down();
+
+    /* both sticks sweeping, the hat going round, a button tapped */
+    for(j=0; j<EVENT_BATCH; j++){
+        evs[j].op = OMIMIC_EV_PAD_AXIS;
+        evs[j].code = j % (OMIMIC_PAD_HAT + 1);
+        evs[j].value = (j * 1021) % 65535 - 32767;
+        if(j % 8 == 7){
+            evs[j].op = (j & 8) ? 
+                OMIMIC_EV_PAD_BTN_UP : OMIMIC_EV_PAD_BTN_DOWN;
+            evs[j].code = 0;
+        }
+    }
+    events("event ioctl, gamepad sweeps", evs, &pad_ep);
+    kshim_set_param("gamepad", 0);
+}
+
+/* 
+ * a feeder paced by the completion eventfd: it tops the pool up by 
+ * as many reports as the host took, so it never runs into -EBUSY.
+ */
+static void bench_feed(void)
+{
+    struct omimic_queue_stats stats;
+    struct omimic_ep_stats *st = &stats.ep[OMIMIC_EP_KBD];
+    u8 kbd[KBD_BUFSIZE] = { 0 };
+    unsigned long i, busy = 0, sent = 0, bad = 0;
+    loff_t pos = 0;
+    u64 n;
+    double t;
+    int efd;
+
+    efd = eventfd(0, EFD_NONBLOCK);
+    gadget_up();
+    if(efd < 0 || kbd_file.f_op->unlocked_ioctl(&kbd_file, 
+           OMIMIC_IOC_COMPLETION_EVENTFD, (unsigned long)&efd)){
+        fprintf(stderr, "can't set the completion eventfd, abort.\n");
+        exit(1);
+    }
+    /* fill the queue once, then keep pace */
+    n = 0;
+    while(kbd_file.f_op->write(&kbd_file, (void *)kbd, KBD_BUFSIZE, &pos) 
+          == KBD_BUFSIZE)
+        n++;
+    sent = n;
+
+    t = now_ns();
+    for(i=0; i<nr_iter; i++){
+        kshim_host_poll(kbd_ep, NULL, 0);
+        if(read(efd, &n, sizeof(n)) != sizeof(n)) n = 0;
+        for(; n; n--, sent++){
+            kbd[2] = 0x04 + (sent & 0x1f);
+            if(kbd_file.f_op->write(&kbd_file, (void *)kbd, KBD_BUFSIZE, 
+                                    &pos) != KBD_BUFSIZE)
+                busy++;
+        }
+    }
+    report("eventfd-paced feed kbd", i, now_ns() - t);
+
+    kbd_file.f_op->unlocked_ioctl(&kbd_file, OMIMIC_IOC_QUEUE_STATS, 
+                                  (unsigned long)&stats);
+    if(st->in_flight != st->busy || st->completed != (u32)i)
+        bad++;
+    printf("%-36s %10lu -EBUSY, idle %u busy %u in flight %u%s\n", "", 
+           busy, st->idle, st->busy, st->in_flight, bad ? " (BAD)" : "");
+    drain(kbd_ep);
+    gadget_down();
+    close(efd);
+}
+
+/* 
+ * requests lost on a failed submission or a disconnect shrink the pool 
+ * for good. every cycle fails a few writes, fills the queue, pulls the 
+ * cable, and checks that the whole pool is idle again.
+ */
+static void bench_disconnect(void)
+{
+    struct omimic_queue_stats stats;
+    struct omimic_ep_stats *st = &stats.ep[OMIMIC_EP_KBD];
+    u8 kbd[KBD_BUFSIZE] = { 0 };
+    unsigned long i, n = nr_iter / 100 ? nr_iter / 100 : 1;
+    unsigned long queued = 0, failed = 0, bad = 0;
+    loff_t pos = 0;
+    double t = 0, t0;
+    int j;
+
+    for(i=0; i<n; i++){
+        gadget_up();
+        /* the UDC refuses the submission */
+        kbd_ep->enabled = 0;
+        for(j=0; j<4; j++)
+            if(kbd_file.f_op->write(&kbd_file, (void *)kbd, KBD_BUFSIZE, 
+                                    &pos) == -ESHUTDOWN)
+                failed++;
+        kbd_ep->enabled = 1;
+        while(kbd_file.f_op->write(&kbd_file, (void *)kbd, KBD_BUFSIZE, 
+                                   &pos) == KBD_BUFSIZE)
+            queued++;
+
+        t0 = now_ns();
+        kshim_disconnect();
+        t += now_ns() - t0;
+
+        kbd_file.f_op->unlocked_ioctl(&kbd_file, OMIMIC_IOC_QUEUE_STATS, 
+                                      (unsigned long)&stats);
+        if(st->busy || st->in_flight || !st->idle) bad++;
+        gadget_down();
+    }
+    report("disconnect with a full queue", i, t);
+    printf("%-36s %10lu queued, %lu failed, %lu pools short%s\n", "", 
+           queued, failed, bad, bad ? " (BAD)" : "");
+}
+
+/* 
+ * the host re-enumerates with a key change still pending, or in flight 
+ * and lost. the endpoints are only enabled again, and the change goes 
+ * out right away.
+ */
+static void bench_reconnect(void)
+{
+    struct omimic_queue_stats stats;
+    struct omimic_ep_stats *st = &stats.ep[OMIMIC_EP_KBD];
+    struct omimic_event ev = { .op = OMIMIC_EV_KEY_DOWN };
+    struct omimic_event_batch batch = { 1, 0, (unsigned long)&ev };
+    u8 kbd[KBD_BUFSIZE] = { 0 }, got[KBD_BUFSIZE];
+    unsigned long i, bad = 0;
+    loff_t pos = 0;
+    double t = 0, t0;
+
+    gadget_up();
+    for(i=0; i<nr_iter; i++){
+        /* queued behind the full pool, or sent right away */
+        while(!(i & 4) && kbd_file.f_op->write(&kbd_file, (void *)kbd, 
+                                               KBD_BUFSIZE, &pos) 
+                          == KBD_BUFSIZE);
+        ev.op = (i & 1) ? OMIMIC_EV_KEY_UP : OMIMIC_EV_KEY_DOWN;
+        ev.code = 0x04;
+        file.f_op->unlocked_ioctl(&file, OMIMIC_IOC_EVENTS, 
+                                  (unsigned long)&batch);
+        /* a cable pull, or a plain re-enumeration */
+        if(i & 2)
+            kshim_disconnect();
+        else
+            set_config(0);
+
+        t0 = now_ns();
+        set_config(KM_CONF_VAL);
+        if(kshim_host_poll(kbd_ep, got, KBD_BUFSIZE) != KBD_BUFSIZE 
+           || got[2] != ((i & 1) ? 0 : 0x04))
+            bad++;
+        t += now_ns() - t0;
+
+        file.f_op->unlocked_ioctl(&file, OMIMIC_IOC_QUEUE_STATS, 
+                                  (unsigned long)&stats);
+        if(st->busy || st->in_flight) bad++;
+    }
+    report("reconfigure->first report", i, t);
+    printf("%-36s %10lu bad cycles%s\n", "", bad, bad ? " (BAD)" : "");
+    gadget_down();
+}
+
+static void bench_splice(void)
+{
+    static u8 data[SPLICE_CHUNK];
+    struct pipe_inode_info pipe;
+    unsigned long done = 0;
+    ssize_t ret;
+    double t;
+
+    memset(&pipe, 0, sizeof(pipe));
+    gadget_up();
+    t = now_ns();
+    while(done < nr_iter * KBD_BUFSIZE){
+        kshim_pipe_push(&pipe, data, sizeof(data));
+        while(pipe.nrbufs){
+            ret = file.f_op->splice_write(&pipe, &file, NULL,
+                                          sizeof(data), 0);
+            if(ret > 0) done += ret;
+            drain(kbd_ep);
+        }
+    }
+    report("splice->complete kbd", done / KBD_BUFSIZE, now_ns() - t);
+    gadget_down();
+}
+
+/* 
+ * mouse motion at MOVES_PER_FRAME events per frame, against a host 
+ * polling every bInterval frames on the virtual clock. each move is 
+ * one unit on X, so a report carries the count of the oldest moves.
+ */
+static void sched_run(const char *name, int aligned)
+{
+    struct omimic_event ev = { OMIMIC_EV_MOUSE_MOVE, OMIMIC_AXIS_X, 1 };
+    struct omimic_event_batch batch = { 1, 0, (unsigned long)&ev };
+    static s64 moved_at[4096];
+    unsigned long poll, nr_polls, head = 0, tail = 0, reports = 0;
+    double lat = 0, max_lat = 0, l;
+    u8 buf[MOUSE_BUFSIZE];
+    s64 period;
+    int j, n, moves;
+
+    kshim_set_param("sched_aligned", aligned);
+    kshim_clock_ns = 0;
+    gadget_up();
+    period = (s64)FRAME_NS * mouse_ep->desc->bInterval;
+    moves = MOVES_PER_FRAME * mouse_ep->desc->bInterval;
+    nr_polls = nr_iter / moves;
+    for(poll=0; poll<nr_polls; poll++){
+        for(j=0; j<moves; j++){
+            kshim_clock_ns = poll * period 
+                + (j * period + rand() % period) / moves;
+            kshim_run_hrtimers();
+            if(file.f_op->unlocked_ioctl(&file, OMIMIC_IOC_EVENTS, 
+                                         (unsigned long)&batch) == 1)
+                moved_at[head++ % 4096] = kshim_clock_ns;
+        }
+        kshim_clock_ns = (poll + 1) * period;
+        kshim_run_hrtimers();
+        if(kshim_host_poll(mouse_ep, buf, MOUSE_BUFSIZE) < 0) continue;
+        reports++;
+        for(n=(s8)buf[1]; n>0 && tail<head; n--){
+            l = kshim_clock_ns - moved_at[tail++ % 4096];
+            lat += l;
+            if(l > max_lat) max_lat = l;
+        }
+    }
+    report(name, head, (double)kshim_clock_ns);
+    printf("%-36s %10lu reports, move->poll %.0f us avg, %.0f us max\n",
+           "", reports, tail ? lat / tail / 1000 : 0.0, max_lat / 1000);
+    drain(mouse_ep);
+    gadget_down();
+    kshim_set_param("sched_aligned", 0);
+}
+
+static void bench_sched(void)
+{
+    sched_run("mouse moves, queued at once", 0);
+    sched_run("mouse moves, poll-aligned", 1);
+}
+
+/* 
+ * composite mode: ID-prefixed reports on /dev/omimic, plain ones on 
+ * the per-endpoint nodes, all polled from the one endpoint.
+ */
+static void bench_composite(void)
+{
+    struct usb_ctrlrequest ctrl = {
+        .bRequestType = USB_DIR_IN,
+        .bRequest = USB_REQ_GET_DESCRIPTOR,
+        .wValue = cpu_to_le16(USB_DT_CONFIG << 8),
+        .wLength = cpu_to_le16(EP0_BUF),
+    };
+    u8 kbd[1 + KBD_BUFSIZE] = { 1 };
+    u8 mouse[1 + MOUSE_BUFSIZE] = { 2, 0, 1, 1, 0 };
+    u8 buf[EP0_BUF];
+    unsigned long i, bad = 0;
+    loff_t pos = 0;
+    int len;
+    double t;
+
+    kshim_set_param("composite", 1);
+    gadget_up();
+    len = kshim_host_setup(&ctrl, buf, sizeof(buf));
+    if(len <= 4 || buf[4] != 1)
+        fprintf(stderr, "composite config: %d bytes, %d interfaces\n", 
+                len, len > 4 ? buf[4] : 0);
+    t = now_ns();
+    for(i=0; i<nr_iter; i++){
+        kbd[3] = i & 0x7f;
+        if(i & 1){
+            dev_write(kbd, sizeof(kbd));
+            dev_write(mouse, sizeof(mouse));
+        }else{
+            kbd_file.f_op->write(&kbd_file, (void *)(kbd + 1), 
+                                 KBD_BUFSIZE, &pos);
+            mouse_file.f_op->write(&mouse_file, (void *)(mouse + 1), 
+                                   MOUSE_BUFSIZE, &pos);
+        }
+        if(kshim_host_poll(kbd_ep, buf, sizeof(buf)) != sizeof(kbd) 
+           || memcmp(buf, kbd, sizeof(kbd)))
+            bad++;
+        if(kshim_host_poll(kbd_ep, buf, sizeof(buf)) != sizeof(mouse) 
+           || memcmp(buf, mouse, sizeof(mouse)))
+            bad++;
+    }
+    report("composite write->complete", 2 * i, now_ns() - t);
+    printf("%-36s %10lu bad reports\n", "", bad);
+    gadget_down();
+    kshim_set_param("composite", 0);
+}
+
+/* writers on kbd & mouse nodes against one host thread polling both */
+static volatile int writers_done;
+
+static void *writer_thread(void *arg)
+{
+    u8 buf[KBD_BUFSIZE] = { 0 };
+    unsigned long i, n = nr_iter / nr_threads, busy = 0;
+    struct file *f = ((long)arg & 1) ? &mouse_file : &kbd_file;
+    size_t count = ((long)arg & 1) ? MOUSE_BUFSIZE : KBD_BUFSIZE;
+    loff_t pos = 0;
+
+    for(i=0; i<n; ){
+        if(f->f_op->write(f, (void *)buf, count, &pos) == (ssize_t)count) 
+            i++;
+        else{
+            /* back off like a real feeder, or a lone CPU never 
+             * gets to the host thread */
+            busy++;
+            sched_yield();
+        }
+    }
+    return (void *)busy;
+}
+
+static void *host_thread(void *arg)
+{
+    (void)arg;
+    while(!writers_done){
+        if(kshim_host_poll(kbd_ep, NULL, 0) < 0 
+           && kshim_host_poll(mouse_ep, NULL, 0) < 0)
+            sched_yield();
+        else
+            kshim_host_poll(mouse_ep, NULL, 0);
+    }
+    drain(kbd_ep);
+    drain(mouse_ep);
+    return NULL;
+}
+
+static void bench_contention(void)
+{
+    pthread_t host, writers[nr_threads];
+    unsigned long busy = 0;
+    char name[64];
+    void *ret;
+    double t;
+    long i;
+
+    gadget_up();
+    writers_done = 0;
+    t = now_ns();
+    pthread_create(&host, NULL, host_thread, NULL);
+    for(i=0; i<nr_threads; i++)
+        pthread_create(&writers[i], NULL, writer_thread, (void *)i);
+    for(i=0; i<nr_threads; i++){
+        pthread_join(writers[i], &ret);
+        busy += (unsigned long)ret;
+    }
+    writers_done = 1;
+    pthread_join(host, NULL);
+
+    snprintf(name, sizeof(name), "contention, %d writers", nr_threads);
+    report(name, nr_iter / nr_threads * nr_threads, now_ns() - t);
+    printf("%-36s %10lu -EBUSY\n", "", busy);
+    gadget_down();
+}
+
+
+static struct bench benches[] = {
+    { "enum", bench_enum },
+    { "leds", bench_leds },
+    { "write", bench_write },
+    { "burst", bench_burst },
+    { "exhaust", bench_exhaust },
+    { "shrink", bench_shrink },
+    { "events", bench_events },
+    { "gamepad", bench_gamepad },
+    { "feed", bench_feed },
+    { "disconnect", bench_disconnect },
+    { "reconnect", bench_reconnect },
+    { "splice", bench_splice },
+    { "contention", bench_contention },
+    { "sched", bench_sched },
+    { "composite", bench_composite },
+    { NULL, NULL },
+};
+
+
+int main(int argc, char **argv)
+{
+    struct bench *b;
+    int opt, i, ran = 0;
+
+    while((opt = getopt(argc, argv, "n:t:v")) != -1){
+        switch(opt){
+        case 'n': nr_iter = strtoul(optarg, NULL, 0); break;
+        case 't': nr_threads = atoi(optarg); break;
+        case 'v': kshim_verbose = 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-t threads] [-v] "
+                    "[bench ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(nr_threads < 1) nr_threads = 1;
+
+    if(kshim_module_init()){
+        fprintf(stderr, "module init failed, abort.\n");
+        return 1;
+    }
+
+    for(b = benches; b->name; b++){
+        if(optind < argc){
+            for(i=optind; i<argc && strcmp(argv[i], b->name); i++);
+            if(i == argc) continue;
+        }
+        b->run();
+        ran++;
+    }
+
+    kshim_module_exit();
+    return ran ? 0 : 1;
+}
@@ -17,6 +17,7 @@
 
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/spinlock.h>
 #include <linux/device.h>
 #include <linux/usb/ch9.h>
@@ -27,8 +28,25 @@
 #include <linux/cdev.h>
 #include <linux/ioctl.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/cache.h>
+#include <linux/timer.h>
+#include <linux/jiffies.h>
+#include <linux/bitmap.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/file.h>
+#include <asm/atomic.h>
 #include <asm/uaccess.h>
 
+#include "omimic.h"
+
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Kay Zheng");
@@ -37,7 +55,35 @@ MODULE_AUTHOR("Kay Zheng");
 #define USB_BUFSIZE 256
 #define KBD_BUFSIZE 8
 #define MOUSE_BUFSIZE 4
+#define GAMEPAD_BUFSIZE 11
+#define NR_KBD_KEYS 6
+#define NR_MOUSE_BTNS 3
+#define NR_PAD_BTNS 16
+#define NR_PAD_AXES 4
+#define PAD_HAT_NULL 8     /* outside the logical range: centered */
+#define NR_EVENTS_CHUNK 32
 #define NR_REQ 10
+#define NR_REQ_MIN 2
+#define NR_REQ_MAX 64
+#define POOL_IDLE_MS 1000
+#define SCHED_LEAD_US 250
+#define FRAME_NS 1000000   /* full speed */
+#define NR_FRAMES 2048     /* the frame counter wraps here */
+#define NR_STRINGS 7       /* the language table and omimic_strings */
+#define NR_LED_REPORTS 16
+#define NR_INTFS 3
+
+/* the report IDs in composite mode */
+#define REPORT_ID_KBD 1
+#define REPORT_ID_MOUSE 2
+#define REPORT_ID_PAD 3
+
+/* char device minors: the legacy node tells kbd & mouse by the size */
+#define OMIMIC_MINOR 0
+#define OMIMIC_MINOR_KBD 1
+#define OMIMIC_MINOR_MOUSE 2
+#define OMIMIC_MINOR_PAD 3
+#define NR_NODES 4
 
 
 #ifdef OMIMIC_DEBUG
@@ -55,26 +101,180 @@ MODULE_AUTHOR("Kay Zheng");
 
 /************* types **************/
 
-struct omimic_dev {
-    struct usb_request *ctrl_req;
+/* 
+ * the requests of one endpoint. the omimic_req slots and the report 
+ * buffers all live in one cache-aligned arena, allocated at bind time 
+ * and released as a unit at unbind time.
+ * slots without a usb_request (the pool has been shrunk, or has not 
+ * grown that far yet) are kept in free_list.
+ */
+struct omimic_pool {
     struct list_head idle_list;
     struct list_head busy_list;
+    struct list_head free_list;
+
+    void *arena;
+    void *complete;
+    int size;
+    int nr_slots;
+    int nr_req;
+    int nr_min;   /* an adaptive pool shrinks down to this */
+
+    atomic_t in_flight;   /* queued to the UDC, not completed yet */
+    atomic_t nr_failed;   /* completed with an error, still in busy_list */
+    unsigned completed;
+
+    /* 
+     * state snapshots not handed to the UDC yet, oldest first. they 
+     * are queued after odev->lock is dropped, by one caller at a time 
+     * (draining), so that they reach the host in the order taken.
+     */
+    struct list_head queue_list;
+    unsigned draining:1;
+};
+
+/* 
+ * poll phase of an interrupt endpoint. a report completes right at a 
+ * host poll, and the polls are bInterval frames apart, so the last 
+ * completion tells when the next polls are due.
+ */
+struct omimic_sched {
+    struct hrtimer timer;
+    struct omimic_dev *odev;
+    ktime_t last_poll;
+    int last_frame;    /* frame number at last_poll, < 0 if unknown */
+    int frame_ns;      /* length of a host frame in local time */
+    unsigned synced:1; /* last_poll is valid */
+};
+
+struct omimic_blob {
+    u8 *buf;
+    int len;
+};
+
+/* 
+ * all the descriptors served on ep0, built once at bind time into one 
+ * kmalloc'ed arena, since the UDC may DMA straight from them. 
+ * strings[0] is the language table, the rest follow omimic_strings.
+ */
+struct omimic_descs {
+    u8 *arena;
+    struct omimic_blob dev;
+    struct omimic_blob qualifier;
+    struct omimic_blob config;
+    struct omimic_blob other_config;
+    struct omimic_blob reports[NR_INTFS];  /* by interface number */
+    struct omimic_blob strings[NR_STRINGS];
+};
+
+/* a char device node, nodes[minor] in omimic_dev */
+struct omimic_node {
+    struct omimic_dev *odev;
+    struct device dev;
+
+    /* signaled on completions, set by eventfd_owner. under odev->lock */
+    struct file *eventfd;
+    struct file *eventfd_owner;
+};
+
+/* file->private_data */
+struct omimic_file {
+    struct omimic_node *node;
+
+    /* a spliced kbd report may span two pipe buffers, the first 
+     * part waits here for the rest. under odev->splice_mutex */
+    u8 splice_buf[KBD_BUFSIZE];
+    unsigned splice_len;
+};
+
+static inline struct omimic_node *file_node(struct file *file)
+{
+    return ((struct omimic_file *)file->private_data)->node;
+}
+
+struct omimic_dev {
+    struct usb_gadget *gadget;
+    struct usb_request *ctrl_req;
+    u8 *ctrl_buf;   /* ctrl_req->buf, unless it points into descs */
+    struct omimic_descs descs;
 
     struct usb_ep *kbd_ep;
-    struct usb_ep *mouse_ep;
+    struct usb_ep *mouse_ep;   /* == kbd_ep in composite mode */
+    struct usb_ep *pad_ep;     /* ditto */
+    const struct usb_endpoint_descriptor *kbd_desc;
+    const struct usb_endpoint_descriptor *mouse_desc;
+    const struct usb_endpoint_descriptor *pad_desc;
+    int id_len;   /* 1 if the reports start with a report ID */
+    struct omimic_pool kbd_pool;
+    struct omimic_pool mouse_pool;
+    struct omimic_pool pad_pool;
+    struct timer_list pool_timer;  /* shrinks adaptive pools when idle */
+    wait_queue_head_t room_wait;   /* a write may not get -EBUSY now */
+
+    /* 
+     * state kept for the event interface. *_touched records what 
+     * changed since the last report was assembled: a second change 
+     * to the same key/button must not be collapsed into that report.
+     */
+    u8 kbd_state[KBD_BUFSIZE];
+    DECLARE_BITMAP(kbd_touched, 256);
+    unsigned kbd_dirty:1;
+    u8 mouse_btns;
+    u8 mouse_touched;
+    int mouse_dx, mouse_dy, mouse_wheel;
+    unsigned mouse_dirty:1;
+    u8 pad_state[GAMEPAD_BUFSIZE];  /* axes & hat are absolute */
+    u16 pad_touched;
+    unsigned pad_dirty:1;
+
+    /* 
+     * output (LED) reports from SET_REPORT, kept for read(). a reader 
+     * keeps the sequence number of the next report it wants in f_pos.
+     */
+    u8 leds[NR_LED_REPORTS];
+    unsigned leds_seq;   /* number of reports received */
+    wait_queue_head_t leds_wait;
+
+    /* used in the sched_aligned mode only */
+    struct omimic_sched kbd_sched;
+    struct omimic_sched mouse_sched;
+    struct omimic_sched pad_sched;
 
     spinlock_t lock;   /* this lock protects the whole structure */
     u8 cur_config;
+    /* the endpoints are claimed at bind time and kept until unbind, 
+     * this tells whether the host has them configured */
+    unsigned ep_enabled:1;
+
+    /* while suspended, reports collapse into the kbd/mouse state */
+    unsigned suspended:1;
+    unsigned remote_wakeup:1;   /* enabled by the host */
+    unsigned wakeup_pending:1;
+
+    struct mutex splice_mutex;   /* serializes splice_write */
 
     dev_t devno;
     struct cdev cdev;
 
-    struct device dev;
+    struct omimic_node nodes[NR_NODES];
 };
 
+/* 
+ * a failed completion can't take odev->lock, usb_ep_disable() gives 
+ * the requests back from under it. the request is only flagged, and 
+ * reclaim_reqs() puts it back in idle_list later.
+ */
+#define OREQ_FAILED 0
+/* the report is a state snapshot, the state is dirty again if it fails */
+#define OREQ_STATE 1
+
 struct omimic_req {
     struct usb_request *req;
+    struct omimic_pool *pool;
     struct list_head list;
+    struct list_head queue;   /* in pool->queue_list */
+    unsigned long flags;
+    u8 *buf;  /* report buffer of this slot in the arena */
 };
 
 
@@ -90,20 +290,64 @@ static void omimic_resume(struct usb_gadget *);
 static int  omimic_set_config(struct usb_gadget*, unsigned, unsigned);
 
 static void omimic_setup_complete(struct usb_ep *, struct usb_request *);
+static void omimic_set_report_complete(struct usb_ep *, 
+                                       struct usb_request *);
 static void intr_complete(struct usb_ep *, struct usb_request *);
 
 static int set_km_config(struct usb_gadget *, unsigned);
 static void omimic_reset_config(struct usb_gadget*);
+static void kick_dirty_state(struct omimic_dev *);
 static void __free_ep_req(struct usb_ep *ep, struct usb_request *req);
-static int config_buf(struct usb_gadget *, u8 *, u8, unsigned);
-static struct usb_request *alloc_ep_req(struct usb_ep*, unsigned);
-static int populate_req_list(struct list_head *, struct usb_ep *, 
-                             void *, int, int);
-
+static int build_desc_blobs(struct omimic_dev *);
+static int serve_blob(struct usb_request *, const struct omimic_blob *, u16);
+static int populate_req_pool(struct omimic_pool *, struct usb_ep *, 
+                             void *, int, int, int, int);
+static void free_req_pool(struct omimic_pool *, struct usb_ep *);
+static struct omimic_req *get_idle_req(struct omimic_dev *, 
+                                       struct omimic_pool *, 
+                                       struct usb_ep *);
+static int pool_has_room(struct omimic_dev *, struct omimic_pool *);
+static void put_idle_req(struct omimic_dev *, struct omimic_req *);
+static void reclaim_reqs(struct omimic_dev *, struct omimic_pool *);
+static void shrink_req_pool(struct omimic_pool *, struct usb_ep *, int);
+static void omimic_pool_timer(unsigned long);
+
+static int add_node(struct omimic_dev *, int, const char *);
 static int omimic_open(struct inode *, struct file *);
 static int omimic_release(struct inode *, struct file *);
 static ssize_t omimic_write(struct file *, const char __user *, 
                             size_t, loff_t *);
+static ssize_t omimic_read(struct file *, char __user *, size_t, loff_t *);
+static unsigned int omimic_poll(struct file *, poll_table *);
+static long omimic_ioctl(struct file *, unsigned int, unsigned long);
+static ssize_t omimic_splice_write(struct pipe_inode_info *, struct file *,
+                                   loff_t *, size_t, unsigned int);
+static int omimic_splice_actor(struct pipe_inode_info *, 
+                               struct pipe_buffer *, struct splice_desc *);
+static int omimic_event(struct omimic_dev *, const struct omimic_event *);
+static void get_ep_stats(struct omimic_dev *, struct omimic_pool *, 
+                         struct omimic_ep_stats *);
+static int splice_report(struct omimic_dev *, const u8 *);
+static int set_completion_eventfd(struct omimic_node *, struct file *, 
+                                  int);
+static struct omimic_req *snapshot_kbd_state(struct omimic_dev *);
+static struct omimic_req *snapshot_mouse_state(struct omimic_dev *);
+static struct omimic_req *snapshot_pad_state(struct omimic_dev *);
+static struct omimic_req *snapshot_state(struct omimic_dev *, int);
+static void queue_state_reqs(struct omimic_dev *, struct omimic_pool *, 
+                             struct usb_ep *);
+static void restore_state(struct omimic_dev *, struct omimic_req *);
+static void collapse_report(struct omimic_dev *, int, const u8 *);
+static int report_collides(struct omimic_dev *, int, const u8 *);
+static struct omimic_req *kick_kbd_state(struct omimic_dev *);
+static struct omimic_req *kick_mouse_state(struct omimic_dev *);
+static struct omimic_req *kick_pad_state(struct omimic_dev *);
+static struct omimic_req *kick_state(struct omimic_dev *, int);
+static void sched_init(struct omimic_dev *, struct omimic_sched *);
+static void sched_polled(struct omimic_dev *, struct omimic_sched *);
+static int sched_arm(struct omimic_sched *, int);
+static enum hrtimer_restart omimic_sched_timer(struct hrtimer *);
+static void omimic_wakeup(struct omimic_dev *);
 
 int  __init omimic_init(void);
 void __exit omimic_exit(void);
@@ -111,12 +355,66 @@ module_init(omimic_init);
 module_exit(omimic_exit);
 
 
+/************* module parameters **************/
+
+static int pool_depth = NR_REQ;
+module_param(pool_depth, int, S_IRUGO);
+MODULE_PARM_DESC(pool_depth, "initial number of requests per endpoint");
+
+static int pool_min = NR_REQ_MIN;
+module_param(pool_min, int, S_IRUGO);
+MODULE_PARM_DESC(pool_min, "lower bound of the request pool depth");
+
+static int pool_max = NR_REQ_MAX;
+module_param(pool_max, int, S_IRUGO);
+MODULE_PARM_DESC(pool_max, "upper bound of the request pool depth");
+
+static int pool_adaptive = 0;
+module_param(pool_adaptive, bool, S_IRUGO);
+MODULE_PARM_DESC(pool_adaptive, 
+                 "grow the pools under -EBUSY pressure, shrink them when idle");
+
+static int pool_idle_ms = POOL_IDLE_MS;
+module_param(pool_idle_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(pool_idle_ms, 
+                 "ms without pressure before an adaptive pool shrinks");
+
+static int sched_aligned = 0;
+module_param(sched_aligned, bool, S_IRUGO);
+MODULE_PARM_DESC(sched_aligned, 
+                 "hold reports back and send them right before the host polls");
+
+static int gamepad = 0;
+module_param(gamepad, bool, S_IRUGO);
+MODULE_PARM_DESC(gamepad, 
+                 "add a gamepad, if the UDC has an endpoint left for it");
+
+static int pad_interval = 1;
+module_param(pad_interval, int, S_IRUGO);
+MODULE_PARM_DESC(pad_interval, "gamepad polling interval, in frames");
+
+static int composite = 0;
+module_param(composite, bool, S_IRUGO);
+MODULE_PARM_DESC(composite, 
+                 "put kbd & mouse on one interface and endpoint, "
+                 "with report IDs");
+
+static int sched_lead_us = SCHED_LEAD_US;
+module_param(sched_lead_us, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sched_lead_us, 
+                 "us before the predicted poll that a held report is queued");
+
+
 /************* other globals **************/
 
 static struct file_operations omimic_fops = {
     .open    = omimic_open,
     .release = omimic_release,
     .write   = omimic_write,
+    .read    = omimic_read,
+    .poll    = omimic_poll,
+    .unlocked_ioctl = omimic_ioctl,
+    .splice_write = omimic_splice_write,
     .owner   = THIS_MODULE,
 };
 
@@ -203,6 +501,54 @@ __u8 mouse_report_desc[] = {
     0xc0,           /* End Collection                   */
 };
 
+__u8 pad_report_desc[] = {
+    0x05, 0x01,     /* Usage Page (Generic Desktop) */
+    0x09, 0x05,     /* Usage (Game Pad) */
+    0xa1, 0x01,     /* Collection (Application) */
+
+    /* 16 bits for 16 buttons */
+    0x05, 0x09,     /*      Usage Page (Button) */
+    0x19, 0x01,     /*      Usage Minimum (1)   */
+    0x29, 0x10,     /*      Usage Maximum (16)  */
+    0x15, 0x00,     /*      Logical Minimum (0) */
+    0x25, 0x01,     /*      Logical Maximum (1) */
+    0x75, 0x01,     /*      Report Size (1)     */
+    0x95, 0x10,     /*      Report Count (16)   */
+    0x81, 0x02,     /*      Input (Data, Variable, Absolute) */
+
+    /* 4 bits for the hat, in steps of 45 degrees */
+    0x05, 0x01,     /*      Usage Page (Generic Desktop) */
+    0x09, 0x39,     /*      Usage (Hat switch)  */
+    0x15, 0x00,     /*      Logical Minimum (0) */
+    0x25, 0x07,     /*      Logical Maximum (7) */
+    0x35, 0x00,     /*      Physical Minimum (0) */
+    0x46, 0x3b, 0x01, /*    Physical Maximum (315) */
+    0x65, 0x14,     /*      Unit (Degrees)      */
+    0x75, 0x04,     /*      Report Size (4)     */
+    0x95, 0x01,     /*      Report Count (1)    */
+    0x81, 0x42,     /*      Input (Data, Variable, Absolute, Null) */
+    0x45, 0x00,     /*      Physical Maximum (0) */
+    0x65, 0x00,     /*      Unit (None)         */
+
+    /* 4 padding bits */
+    0x75, 0x04,     /*      Report Size (4)     */
+    0x95, 0x01,     /*      Report Count (1)    */
+    0x81, 0x01,     /*      Input (Constant)    */
+
+    /* 64 bits for 4 axes, little endian */
+    0x09, 0x30,     /*      Usage (X)           */
+    0x09, 0x31,     /*      Usage (Y)           */
+    0x09, 0x33,     /*      Usage (Rx)          */
+    0x09, 0x34,     /*      Usage (Ry)          */
+    0x16, 0x01, 0x80, /*    Logical Minimum (-32767) */
+    0x26, 0xff, 0x7f, /*    Logical Maximum (32767) */
+    0x75, 0x10,     /*      Report Size (16)    */
+    0x95, 0x04,     /*      Report Count (4)    */
+    0x81, 0x02,     /*      Input (Data, Variable, Absolute) */
+
+    0xc0,           /* End Collection */
+};
+
 
 /************* USB strings **************/
 
@@ -211,11 +557,13 @@ __u8 mouse_report_desc[] = {
 #define STRIDX_SERIAL 129
 #define STRIDX_KBD 249
 #define STRIDX_MOUSE 251
+#define STRIDX_PAD 253
 
 static const char SHORT_NAME[] = "omimic";
 static const char LONG_NAME[]  = "Gadget OMimic";
 static const char STRING_KBD[] = "mimic the keyboard";
 static const char STRING_MOUSE[] = "mimic the mouse";
+static const char STRING_PAD[] = "mimic the gamepad";
 static char STRING_MANUFACTURER[40] = "MadGods Studio";
 static char STRING_SERIAL[40] = "0123456789.0123456789.0123456789";
 
@@ -225,6 +573,7 @@ static struct usb_string omimic_strings[] = {
     { STRIDX_SERIAL, STRING_SERIAL },
     { STRIDX_KBD, STRING_KBD },
     { STRIDX_MOUSE, STRING_MOUSE },
+    { STRIDX_PAD, STRING_PAD },
     { },
 };
 
@@ -263,6 +612,7 @@ static struct usb_qualifier_descriptor omimic_dev_qualifier = {
 
 #define KBD_INTF_NUM 0
 #define MOUSE_INTF_NUM 1
+#define PAD_INTF_NUM 2
 
 /*--------------- kbd descriptors -----------------*/
 
@@ -337,6 +687,43 @@ static struct usb_endpoint_descriptor mouse_ep_desc = {
     .wMaxPacketSize = __constant_cpu_to_le16(MOUSE_BUFSIZE),
 };
 
+/*--------------- gamepad descriptors -----------------*/
+
+static struct usb_interface_descriptor pad_intf = {
+    .bLength = sizeof(pad_intf),
+    .bDescriptorType = USB_DT_INTERFACE,
+    .bInterfaceNumber = PAD_INTF_NUM,
+    .bNumEndpoints = 1,
+    .bInterfaceClass = USB_CLASS_HID,
+    .bInterfaceSubClass = 0,  /* no boot protocol for gamepads */
+    .bInterfaceProtocol = 0,
+    .iInterface = STRIDX_PAD,
+};
+
+static struct hid_descriptor pad_hid_desc = {
+    .bLength = sizeof(pad_hid_desc),
+    .bDescriptorType = 33,  /* hid descriptor */
+    .bcdHID = __constant_cpu_to_le16(0x0110),
+    .bCountryCode = 0,
+    .bNumDescriptors = 1,
+    .desc = {
+        [0] = {
+            .bDescriptorType = 34,  /* report descriptor */
+            .wDescriptorLength = __constant_cpu_to_le16(sizeof(pad_report_desc)),
+        },
+    },
+};
+
+/* bInterval is set from pad_interval at bind time */
+static struct usb_endpoint_descriptor pad_ep_desc = {
+    .bLength = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType = USB_DT_ENDPOINT,
+    .bEndpointAddress = USB_DIR_IN,
+    .bmAttributes = USB_ENDPOINT_XFER_INT,
+    .bInterval = 1,
+    .wMaxPacketSize = __constant_cpu_to_le16(GAMEPAD_BUFSIZE),
+};
+
 const static struct usb_descriptor_header *km_func[] = {
     (struct usb_descriptor_header *) &kbd_intf,
     (struct usb_descriptor_header *) &kbd_hid_desc,
@@ -347,15 +734,96 @@ const static struct usb_descriptor_header *km_func[] = {
     NULL,
 };
 
+const static struct usb_descriptor_header *kmp_func[] = {
+    (struct usb_descriptor_header *) &kbd_intf,
+    (struct usb_descriptor_header *) &kbd_hid_desc,
+    (struct usb_descriptor_header *) &kbd_ep_desc,
+    (struct usb_descriptor_header *) &mouse_intf,
+    (struct usb_descriptor_header *) &mouse_hid_desc,
+    (struct usb_descriptor_header *) &mouse_ep_desc,
+    (struct usb_descriptor_header *) &pad_intf,
+    (struct usb_descriptor_header *) &pad_hid_desc,
+    (struct usb_descriptor_header *) &pad_ep_desc,
+    NULL,
+};
+
+/*--------------- composite descriptors -----------------*/
+
+/* 
+ * kbd, mouse & gamepad on a single interface & endpoint, told apart 
+ * by report IDs, for UDCs short of interrupt endpoints. the boot 
+ * protocol has no report IDs, so this is not a boot interface. the 
+ * gamepad, if there is one, sets the polling interval and the packet 
+ * size; these and the report descriptor size are set at bind time.
+ */
+#define COMP_REPORT_DESC_SIZE \
+    (sizeof(kbd_report_desc) + sizeof(mouse_report_desc) \
+     + sizeof(pad_report_desc) + 6)
+#define REPORT_ID_AT 6  /* right after Collection (Application) */
+
+static struct usb_interface_descriptor comp_intf = {
+    .bLength = sizeof(comp_intf),
+    .bDescriptorType = USB_DT_INTERFACE,
+    .bInterfaceNumber = KBD_INTF_NUM,
+    .bNumEndpoints = 1,
+    .bInterfaceClass = USB_CLASS_HID,
+    .bInterfaceSubClass = 0,
+    .bInterfaceProtocol = 0,
+    .iInterface = STRIDX_PRODUCT,
+};
+
+static struct hid_descriptor comp_hid_desc = {
+    .bLength = sizeof(comp_hid_desc),
+    .bDescriptorType = 33,  /* hid descriptor */
+    .bcdHID = __constant_cpu_to_le16(0x0110),
+    .bCountryCode = 0,
+    .bNumDescriptors = 1,
+    .desc = {
+        [0] = {
+            .bDescriptorType = 34,  /* report descriptor */
+            .wDescriptorLength = 
+                __constant_cpu_to_le16(COMP_REPORT_DESC_SIZE),
+        },
+    },
+};
+
+static struct usb_endpoint_descriptor comp_ep_desc = {
+    .bLength = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType = USB_DT_ENDPOINT,
+    .bEndpointAddress = USB_DIR_IN,
+    .bmAttributes = USB_ENDPOINT_XFER_INT,
+    .bInterval = 10,
+    .wMaxPacketSize = __constant_cpu_to_le16(1 + GAMEPAD_BUFSIZE),
+};
+
+const static struct usb_descriptor_header *comp_func[] = {
+    (struct usb_descriptor_header *) &comp_intf,
+    (struct usb_descriptor_header *) &comp_hid_desc,
+    (struct usb_descriptor_header *) &comp_ep_desc,
+    NULL,
+};
+
 #define KM_CONF_VAL 2
 
 static struct usb_config_descriptor km_config = {
     .bLength = sizeof(km_config),
     .bDescriptorType = USB_DT_CONFIG,
-    .bNumInterfaces = 2,
+    .bNumInterfaces = 2,  /* 3 with the gamepad, set at bind time */
+    .bConfigurationValue = KM_CONF_VAL,
+    .iConfiguration = STRIDX_KBD,
+    .bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_SELFPOWER 
+                    | USB_CONFIG_ATT_WAKEUP,
+    .bMaxPower = 1,
+};
+
+static struct usb_config_descriptor comp_config = {
+    .bLength = sizeof(comp_config),
+    .bDescriptorType = USB_DT_CONFIG,
+    .bNumInterfaces = 1,
     .bConfigurationValue = KM_CONF_VAL,
     .iConfiguration = STRIDX_KBD,
-    .bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_SELFPOWER,
+    .bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_SELFPOWER 
+                    | USB_CONFIG_ATT_WAKEUP,
     .bMaxPower = 1,
 };
 
@@ -365,7 +833,7 @@ static struct usb_config_descriptor km_config = {
 
 static int  omimic_bind(struct usb_gadget *gadget)
 {
-    int ret;
+    int ret, nr_min, nr_max, nr;
     struct omimic_dev *odev;
 
     odev = (struct omimic_dev *)kmalloc(sizeof(*odev), GFP_KERNEL);
@@ -375,14 +843,48 @@ static int  omimic_bind(struct usb_gadget *gadget)
         return -ENOMEM;
     }
     set_gadget_data(gadget, odev);
+    odev->gadget = gadget;
 
     spin_lock_init(&odev->lock);
-    INIT_LIST_HEAD(&odev->idle_list);
-    INIT_LIST_HEAD(&odev->busy_list);
+    mutex_init(&odev->splice_mutex);
+    init_waitqueue_head(&odev->leds_wait);
+    init_waitqueue_head(&odev->room_wait);
+    INIT_LIST_HEAD(&odev->kbd_pool.idle_list);
+    INIT_LIST_HEAD(&odev->kbd_pool.busy_list);
+    INIT_LIST_HEAD(&odev->kbd_pool.free_list);
+    INIT_LIST_HEAD(&odev->mouse_pool.idle_list);
+    INIT_LIST_HEAD(&odev->mouse_pool.busy_list);
+    INIT_LIST_HEAD(&odev->mouse_pool.free_list);
+    INIT_LIST_HEAD(&odev->pad_pool.idle_list);
+    INIT_LIST_HEAD(&odev->pad_pool.busy_list);
+    INIT_LIST_HEAD(&odev->pad_pool.free_list);
+    INIT_LIST_HEAD(&odev->kbd_pool.queue_list);
+    INIT_LIST_HEAD(&odev->mouse_pool.queue_list);
+    INIT_LIST_HEAD(&odev->pad_pool.queue_list);
+    setup_timer(&odev->pool_timer, omimic_pool_timer, (unsigned long)odev);
+    sched_init(odev, &odev->kbd_sched);
+    sched_init(odev, &odev->mouse_sched);
+    sched_init(odev, &odev->pad_sched);
+    odev->pad_state[2] = PAD_HAT_NULL;
+
+    pad_ep_desc.bInterval = clamp_t(int, pad_interval, 1, 255);
+    if(composite){
+        comp_ep_desc.bInterval = gamepad ? pad_ep_desc.bInterval 
+                                         : kbd_ep_desc.bInterval;
+        comp_ep_desc.wMaxPacketSize = 
+            cpu_to_le16(1 + (gamepad ? GAMEPAD_BUFSIZE : KBD_BUFSIZE));
+        odev->kbd_desc = odev->mouse_desc = odev->pad_desc = &comp_ep_desc;
+        odev->id_len = 1;
+    }else{
+        odev->kbd_desc = &kbd_ep_desc;
+        odev->mouse_desc = &mouse_ep_desc;
+        odev->pad_desc = &pad_ep_desc;
+    }
 
     usb_ep_autoconfig_reset(gadget);
     /* kbd endpoint */
-    odev->kbd_ep = usb_ep_autoconfig(gadget, &kbd_ep_desc);
+    odev->kbd_ep = usb_ep_autoconfig(gadget, 
+        (struct usb_endpoint_descriptor *)odev->kbd_desc);
     if(!odev->kbd_ep){
         OMIMIC_PERR("can't automatically config gadget: %s\n", 
                     gadget->name);
@@ -391,8 +893,11 @@ static int  omimic_bind(struct usb_gadget *gadget)
     }
     PDBG("ep configured: %s\n", odev->kbd_ep->name);
     odev->kbd_ep->driver_data = odev;  /* claiming the endpoint */
-    /* mouse endpoint */
-    odev->mouse_ep = usb_ep_autoconfig(gadget, &mouse_ep_desc);
+    /* mouse endpoint, shared with the kbd in composite mode */
+    if(composite)
+        odev->mouse_ep = odev->kbd_ep;
+    else
+        odev->mouse_ep = usb_ep_autoconfig(gadget, &mouse_ep_desc);
     if(!odev->mouse_ep){
         OMIMIC_PERR("can't automatically config gadget: %s\n",
                     gadget->name);
@@ -401,27 +906,56 @@ static int  omimic_bind(struct usb_gadget *gadget)
     }
     PDBG("ep configured: %s\n", odev->mouse_ep->name);
     odev->mouse_ep->driver_data = odev;
+    /* gamepad endpoint, ditto. optional, it costs the host a poll 
+     * every pad_interval frames */
+    if(gamepad && composite)
+        odev->pad_ep = odev->kbd_ep;
+    else if(gamepad)
+        odev->pad_ep = usb_ep_autoconfig(gadget, &pad_ep_desc);
+    if(odev->pad_ep){
+        PDBG("ep configured: %s\n", odev->pad_ep->name);
+        odev->pad_ep->driver_data = odev;
+    }else if(gamepad)
+        OMIMIC_PINFO("no endpoint left for the gamepad, going without\n");
+    km_config.bNumInterfaces = odev->pad_ep ? 3 : 2;
+    comp_hid_desc.desc[0].wDescriptorLength = cpu_to_le16(
+        COMP_REPORT_DESC_SIZE 
+        - (odev->pad_ep ? 0 : sizeof(pad_report_desc) + 2));
 
     odev->ctrl_req = usb_ep_alloc_request(gadget->ep0, GFP_KERNEL);
     if(!odev->ctrl_req){
         omimic_unbind(gadget);
         return -ENOMEM;
     }
-    odev->ctrl_req->buf = kmalloc(USB_BUFSIZE, GFP_KERNEL);
-    if(!odev->ctrl_req->buf){
+    odev->ctrl_buf = kmalloc(USB_BUFSIZE, GFP_KERNEL);
+    odev->ctrl_req->buf = odev->ctrl_buf;
+    if(!odev->ctrl_buf){
         omimic_unbind(gadget);
         return -ENOMEM;
     }
     odev->ctrl_req->complete = omimic_setup_complete;
     PDBG("ep0 standby\n");
 
-    /* XXX: kbd & mouse use the same idle_list, but the list is 
-     *      allocated for kbd_ep.
-     *      In fact, s3c2410_udc_alloc_request() only use the '_ep' 
-     *      to print debug info (see s3c2410_udc.c).
-     */
-    ret = populate_req_list(&odev->idle_list, odev->kbd_ep, 
-                            intr_complete, KBD_BUFSIZE, NR_REQ);
+    /* sane pool bounds, the parameters are left as given */
+    nr_min = max(pool_min, 1);
+    nr_max = max(pool_max, nr_min);
+    nr = clamp_t(int, pool_depth, nr_min, nr_max);
+
+    /* a fixed pool never grows, so don't reserve slots for it */
+    if(!pool_adaptive) nr_min = nr_max = nr;
+    ret = populate_req_pool(&odev->kbd_pool, odev->kbd_ep, 
+                            intr_complete, odev->id_len + KBD_BUFSIZE, 
+                            nr_max, nr_min, nr);
+    if(!ret)
+        ret = populate_req_pool(&odev->mouse_pool, odev->mouse_ep, 
+                                intr_complete, 
+                                odev->id_len + MOUSE_BUFSIZE, 
+                                nr_max, nr_min, nr);
+    if(!ret && odev->pad_ep)
+        ret = populate_req_pool(&odev->pad_pool, odev->pad_ep, 
+                                intr_complete, 
+                                odev->id_len + GAMEPAD_BUFSIZE, 
+                                nr_max, nr_min, nr);
     if(ret){
         omimic_unbind(gadget);
         return ret;
@@ -431,14 +965,21 @@ static int  omimic_bind(struct usb_gadget *gadget)
     gadget->ep0->driver_data = odev;  /* claiming the control ep */
     omimic_dev_desc.bMaxPacketSize0 = gadget->ep0->maxpacket;
     omimic_dev_qualifier.bMaxPacketSize0 = omimic_dev_desc.bMaxPacketSize0;
+
+    ret = build_desc_blobs(odev);
+    if(ret){
+        OMIMIC_PERR("can't build the descriptors, abort\n");
+        omimic_unbind(gadget);
+        return ret;
+    }
     
-    /* ignore OTG devices, and don't support auto resume */
+    /* ignore OTG devices. remote wakeup is done in omimic_wakeup() */
 
     usb_gadget_set_selfpowered(gadget);
 
     /* initialize the char dev */
     PDBG("going to allocate char dev region\n");
-    ret = alloc_chrdev_region(&odev->devno, 0, 1, "omimic");
+    ret = alloc_chrdev_region(&odev->devno, 0, NR_NODES, "omimic");
     if(ret){
         OMIMIC_PERR("error allocating char device region, abort\n");
         omimic_unbind(gadget);
@@ -450,27 +991,20 @@ static int  omimic_bind(struct usb_gadget *gadget)
 
     cdev_init(&odev->cdev, &omimic_fops);
     odev->cdev.owner = THIS_MODULE;
-    ret = cdev_add(&odev->cdev, odev->devno, 1);
+    ret = cdev_add(&odev->cdev, odev->devno, NR_NODES);
     if(ret){
         OMIMIC_PERR("error adding char device, abort\n");
         omimic_unbind(gadget);
         return ret;
     }
 
-    snprintf(odev->dev.bus_id, sizeof(odev->dev.bus_id), "omimic");
-    odev->dev.devt = odev->devno;
-    odev->dev.class = &input_class;
-    odev->dev.parent = NULL;
-    odev->dev.release = NULL;
-    device_initialize(&odev->dev);
-
-    /* flag to indicate that the device is successfully added */
-    odev->dev.driver_data = (void *)1;
-
-    ret = device_add(&odev->dev);
+    ret = add_node(odev, OMIMIC_MINOR, "omimic");
+    if(!ret) ret = add_node(odev, OMIMIC_MINOR_KBD, "omimic-kbd");
+    if(!ret) ret = add_node(odev, OMIMIC_MINOR_MOUSE, "omimic-mouse");
+    if(!ret && odev->pad_ep) 
+        ret = add_node(odev, OMIMIC_MINOR_PAD, "omimic-pad");
     if(ret){
         OMIMIC_PERR("Failed to register device, abort.\n");
-        odev->dev.driver_data = NULL;
         omimic_unbind(gadget);
         return ret;
     }
@@ -478,34 +1012,60 @@ static int  omimic_bind(struct usb_gadget *gadget)
     return 0;
 }
 
+static int add_node(struct omimic_dev *odev, int minor, const char *name)
+{
+    struct device *dev = &odev->nodes[minor].dev;
+    int ret;
+
+    odev->nodes[minor].odev = odev;
+    snprintf(dev->bus_id, sizeof(dev->bus_id), "%s", name);
+    dev->devt = MKDEV(MAJOR(odev->devno), MINOR(odev->devno) + minor);
+    dev->class = &input_class;
+    dev->parent = NULL;
+    dev->release = NULL;
+    device_initialize(dev);
+
+    /* flag to indicate that the device is successfully added */
+    dev->driver_data = (void *)1;
+
+    ret = device_add(dev);
+    if(ret) dev->driver_data = NULL;
+    return ret;
+}
+
 static void omimic_unbind(struct usb_gadget *gadget)
 {
     struct omimic_dev *odev = get_gadget_data(gadget);
-    struct omimic_req *oreq, *tmp_oreq;
+    int i;
+
+    del_timer_sync(&odev->pool_timer);
+    hrtimer_cancel(&odev->kbd_sched.timer);
+    hrtimer_cancel(&odev->mouse_sched.timer);
+    hrtimer_cancel(&odev->pad_sched.timer);
 
-    if(odev->dev.driver_data)
-        device_del(&odev->dev);
+    for(i=0; i<NR_NODES; i++){
+        if(odev->nodes[i].dev.driver_data)
+            device_del(&odev->nodes[i].dev);
+        if(odev->nodes[i].eventfd)
+            fput(odev->nodes[i].eventfd);
+    }
 
     if(odev->cdev.dev) cdev_del(&odev->cdev);
-    if(odev->devno) unregister_chrdev_region(odev->devno, 1);
+    if(odev->devno) unregister_chrdev_region(odev->devno, NR_NODES);
 
     if(odev->kbd_ep) odev->kbd_ep->driver_data = NULL;
     if(odev->mouse_ep) odev->mouse_ep->driver_data = NULL;
+    if(odev->pad_ep) odev->pad_ep->driver_data = NULL;
 
-    if(odev->ctrl_req)
+    if(odev->ctrl_req){
+        odev->ctrl_req->buf = odev->ctrl_buf;
         __free_ep_req(gadget->ep0, odev->ctrl_req);
-
-    list_for_each_entry_safe(oreq, tmp_oreq, &odev->idle_list, list){
-        list_del(&oreq->list);
-        __free_ep_req(odev->kbd_ep, oreq->req);
-        kfree(oreq);
     }
+    kfree(odev->descs.arena);
 
-    list_for_each_entry_safe(oreq, tmp_oreq, &odev->busy_list, list){
-        list_del(&oreq->list);
-        __free_ep_req(odev->kbd_ep, oreq->req);
-        kfree(oreq);
-    }
+    free_req_pool(&odev->kbd_pool, odev->kbd_ep);
+    free_req_pool(&odev->mouse_pool, odev->mouse_ep);
+    free_req_pool(&odev->pad_pool, odev->pad_ep);
 
     set_gadget_data(gadget, NULL);
     kfree(odev);
@@ -517,7 +1077,7 @@ static int  omimic_setup(struct usb_gadget *gadget,
 {
     struct omimic_dev *odev = get_gadget_data(gadget);
     struct usb_request *req = odev->ctrl_req;
-    int ret = -EOPNOTSUPP;
+    int i, ret = -EOPNOTSUPP;
     u16 w_index = le16_to_cpu(ctrl->wIndex);
     u16 w_value = le16_to_cpu(ctrl->wValue);
     u16 w_length = le16_to_cpu(ctrl->wLength);
@@ -526,6 +1086,9 @@ static int  omimic_setup(struct usb_gadget *gadget,
          w_index, w_value, w_length);
 
     req->zero = 0;
+    /* may be left on a blob or a data stage handler last time */
+    req->buf = odev->ctrl_buf;
+    req->complete = omimic_setup_complete;
     switch(ctrl->bRequest){
     case USB_REQ_GET_DESCRIPTOR:
         PDBG("USB_REQ_GET_DESCRIPTOR: ctrl->bRequestType: %x\n", 
@@ -535,48 +1098,43 @@ static int  omimic_setup(struct usb_gadget *gadget,
         switch(w_value >> 8){
         case USB_DT_DEVICE:
             PDBG("    USB_DT_DEVICE\n");
-            ret = min(w_length, (u16)sizeof(omimic_dev_desc));
-            memcpy(req->buf, &omimic_dev_desc, ret);
+            ret = serve_blob(req, &odev->descs.dev, w_length);
             break;
         case USB_DT_DEVICE_QUALIFIER:
             PDBG("    USB_DT_DEVICE_QUALIFIER\n");
             if(!gadget->is_dualspeed)
                 break;
-            ret = min(w_length, (u16)sizeof(omimic_dev_qualifier));
-            memcpy(req->buf, &omimic_dev_qualifier, ret);
+            ret = serve_blob(req, &odev->descs.qualifier, w_length);
             break;
+        /* currently there's only one conf */
         case USB_DT_OTHER_SPEED_CONFIG:
             PDBG("    USB_DT_OTHER_SPEED_CONFIG\n");
             if(!gadget->is_dualspeed)
                 break;
-            /* fall through */
+            ret = (w_value & 0xff) ? -EINVAL : 
+                serve_blob(req, &odev->descs.other_config, w_length);
+            break;
         case USB_DT_CONFIG:
             PDBG("    USB_DT_CONFIG\n");
-            ret = config_buf(gadget, req->buf, w_value>>8, w_value & 0xff);
-            if(ret >= 0)
-                ret = min(w_length, (u16)ret);
+            ret = (w_value & 0xff) ? -EINVAL : 
+                serve_blob(req, &odev->descs.config, w_length);
             break;
         case USB_DT_STRING:
             PDBG("    USB_DT_STRING\n");
-            ret = usb_gadget_get_string(&omimic_strtab, w_value & 0xff, 
-                                        req->buf);
-            if(ret >= 0)
-                ret = min(w_length, (u16)ret);
+            ret = -EINVAL;
+            if((w_value & 0xff) == 0)
+                ret = serve_blob(req, &odev->descs.strings[0], w_length);
+            for(i=0; i<NR_STRINGS-1 && ret < 0; i++)
+                if(omimic_strings[i].id == (w_value & 0xff))
+                    ret = serve_blob(req, &odev->descs.strings[i+1], 
+                                     w_length);
             break;
         case USB_DT_CS_CONFIG:  /* report descriptor */
-            PDBG("    USB_DT_CS_CONFIG\n");
-            switch(w_index){
-            case KBD_INTF_NUM:
-                PDBG("        KBD_INTF_NUM\n");
-                ret = min(w_length, (u16)sizeof(kbd_report_desc));
-                memcpy(req->buf, kbd_report_desc, ret);
-                break;
-            case MOUSE_INTF_NUM:
-                PDBG("        MOUSE_INTF_NUM\n");
-                ret = min(w_length, (u16)sizeof(mouse_report_desc));
-                memcpy(req->buf, mouse_report_desc, ret);
-                break;
-            default:
+            PDBG("    USB_DT_CS_CONFIG: %d\n", w_index);
+            if(w_index < NR_INTFS && odev->descs.reports[w_index].len)
+                ret = serve_blob(req, &odev->descs.reports[w_index], 
+                                 w_length);
+            else{
                 OMIMIC_PERR("unknown interface number: %d\n", w_index);
                 ret = -EINVAL;
             }
@@ -590,14 +1148,24 @@ static int  omimic_setup(struct usb_gadget *gadget,
         PDBG("USB_REQ_SET_CONFIGURATION: ctrl->bRequestType: %x\n", 
              ctrl->bRequestType);
         if(ctrl->bRequestType == (USB_RECIP_INTERFACE | USB_TYPE_CLASS)){
-            /* XXX: handle SET_REPORT request */
-            goto unknown;
+            /* SET_REPORT, only the kbd has an output (LED) report */
+            PDBG("    SET_REPORT\n");
+            if(w_index != KBD_INTF_NUM || (w_value >> 8) != 0x02 
+               || (w_value & 0xff) != (odev->id_len ? REPORT_ID_KBD : 0)
+               || w_length <= odev->id_len || w_length > USB_BUFSIZE)
+                goto unknown;
+            /* the report comes in the data stage */
+            req->complete = omimic_set_report_complete;
+            ret = w_length;
+            break;
         }else if(ctrl->bRequestType != 0)
             goto unknown;
 
         spin_lock(&odev->lock);
         ret = omimic_set_config(gadget, w_value, GFP_ATOMIC);
         spin_unlock(&odev->lock);
+        /* back from a reset, the host gets the pending changes */
+        if(ret == 0) kick_dirty_state(odev);
         break;
     case USB_REQ_GET_CONFIGURATION:
         PDBG("USB_REQ_GET_CONFIGURATION: ctrl->bRequestType: %x\n", 
@@ -620,6 +1188,7 @@ static int  omimic_setup(struct usb_gadget *gadget,
             ret = 0;
         }
         spin_unlock(&odev->lock);
+        if(ret == 0) kick_dirty_state(odev);
         break;
     /* XXX: this value duplicates the SET_IDLE request */
     case USB_REQ_GET_INTERFACE: 
@@ -640,9 +1209,30 @@ static int  omimic_setup(struct usb_gadget *gadget,
         ret = min(w_length, (u16)1);
         break;
     case USB_REQ_GET_STATUS:
-        /* XXX: to be written (seems to be optional) */
+        /* XXX: to be written for interfaces & endpoints 
+         *      (seems to be optional) */
         PDBG("USB_REQ_GET_STATUS: ctrl->bRequestType: %x\n", 
              ctrl->bRequestType);
+        if(ctrl->bRequestType != (USB_DIR_IN | USB_RECIP_DEVICE))
+            break;
+        ((u8*)req->buf)[0] = (1 << USB_DEVICE_SELF_POWERED) 
+                             | (odev->remote_wakeup << USB_DEVICE_REMOTE_WAKEUP);
+        ((u8*)req->buf)[1] = 0;
+        ret = min(w_length, (u16)2);
+        break;
+    /* XXX: these values duplicate the GET_REPORT & GET_PROTOCOL requests */
+    case USB_REQ_CLEAR_FEATURE:
+    case USB_REQ_SET_FEATURE:
+        PDBG("USB_REQ_%s_FEATURE: ctrl->bRequestType: %x\n", 
+             ctrl->bRequest == USB_REQ_SET_FEATURE ? "SET" : "CLEAR",
+             ctrl->bRequestType);
+        if(ctrl->bRequestType != USB_RECIP_DEVICE 
+           || w_value != USB_DEVICE_REMOTE_WAKEUP)
+            goto unknown;
+        spin_lock(&odev->lock);
+        odev->remote_wakeup = (ctrl->bRequest == USB_REQ_SET_FEATURE);
+        spin_unlock(&odev->lock);
+        ret = 0;
         break;
 
     /* class specific requests */
@@ -687,24 +1277,93 @@ static void omimic_setup_complete(struct usb_ep *ep,
     }
 }
 
+/* the data stage of SET_REPORT, the LED state follows the report ID */
+static void omimic_set_report_complete(struct usb_ep *ep, 
+                                       struct usb_request *req)
+{
+    struct omimic_dev *odev = ep->driver_data;
+    u8 leds;
+
+    if(req->status || req->actual <= odev->id_len){
+        omimic_setup_complete(ep, req);
+        return;
+    }
+    leds = ((u8 *)req->buf)[odev->id_len];
+
+    spin_lock(&odev->lock);
+    odev->leds[odev->leds_seq % NR_LED_REPORTS] = leds;
+    odev->leds_seq++;
+    spin_unlock(&odev->lock);
+    PDBG("SET_REPORT --> leds:%02x\n", leds);
+
+    wake_up_interruptible(&odev->leds_wait);
+}
+
 static void omimic_disconnect(struct usb_gadget *gadget)
 {
     unsigned long flags;
     struct omimic_dev *odev = get_gadget_data(gadget);
     spin_lock_irqsave(&odev->lock, flags);
     omimic_reset_config(gadget);
+    odev->suspended = 0;
+    odev->remote_wakeup = 0;
+    odev->wakeup_pending = 0;
     spin_unlock_irqrestore(&odev->lock, flags);
     return;
 }
 
 static void omimic_suspend(struct usb_gadget *gadget)
 {
-    return;
+    struct omimic_dev *odev = get_gadget_data(gadget);
+
+    PDBG("omimic_suspend\n");
+    spin_lock(&odev->lock);
+    odev->suspended = 1;
+    odev->wakeup_pending = 0;
+    spin_unlock(&odev->lock);
+    /* the writes collapse into the state from now on */
+    wake_up_interruptible(&odev->room_wait);
 }
 
+/* send the state collapsed during the suspension */
 static void omimic_resume(struct usb_gadget *gadget)
 {
-    return;
+    struct omimic_dev *odev = get_gadget_data(gadget);
+
+    PDBG("omimic_resume\n");
+    spin_lock(&odev->lock);
+    odev->suspended = 0;
+    odev->wakeup_pending = 0;
+    spin_unlock(&odev->lock);
+    kick_dirty_state(odev);
+}
+
+/* 
+ * send the state changes not sent yet, after a resume or a 
+ * (re)configuration. must be called without odev->lock held.
+ */
+static void kick_dirty_state(struct omimic_dev *odev)
+{
+    struct omimic_req *kbd_oreq = NULL, *mouse_oreq = NULL;
+    struct omimic_req *pad_oreq = NULL;
+    unsigned long flags;
+
+    spin_lock_irqsave(&odev->lock, flags);
+    /* the state lost by failed requests is dirty again */
+    reclaim_reqs(odev, &odev->kbd_pool);
+    reclaim_reqs(odev, &odev->mouse_pool);
+    reclaim_reqs(odev, &odev->pad_pool);
+    if(odev->ep_enabled){
+        if(odev->kbd_dirty) kbd_oreq = kick_kbd_state(odev);
+        if(odev->mouse_dirty) mouse_oreq = kick_mouse_state(odev);
+        if(odev->pad_dirty) pad_oreq = kick_pad_state(odev);
+    }
+    spin_unlock_irqrestore(&odev->lock, flags);
+
+    if(kbd_oreq) queue_state_reqs(odev, &odev->kbd_pool, odev->kbd_ep);
+    if(mouse_oreq) 
+        queue_state_reqs(odev, &odev->mouse_pool, odev->mouse_ep);
+    if(pad_oreq) queue_state_reqs(odev, &odev->pad_pool, odev->pad_ep);
 }
 
 static struct usb_gadget_driver omimic_driver = {
@@ -768,9 +1427,6 @@ static int  omimic_set_config(struct usb_gadget *gadget,
         return res;
     }
 
-    if(!res && !odev->kbd_ep) 
-        res = -ENODEV;
-
     if(res) omimic_reset_config(gadget);
     else{
         char *speed;
@@ -794,30 +1450,134 @@ static void omimic_reset_config(struct usb_gadget *gadget)
 
     PDBG("omimic_reset_config\n");
 
-    if(odev->kbd_ep){
+    /* a running timer callback sees the endpoints disabled */
+    hrtimer_try_to_cancel(&odev->kbd_sched.timer);
+    hrtimer_try_to_cancel(&odev->mouse_sched.timer);
+    hrtimer_try_to_cancel(&odev->pad_sched.timer);
+    odev->kbd_sched.synced = 0;
+    odev->mouse_sched.synced = 0;
+    odev->pad_sched.synced = 0;
+
+    /* the endpoints stay claimed, the next SET_CONFIGURATION only 
+     * enables them again */
+    if(odev->ep_enabled){
         usb_ep_disable(odev->kbd_ep);
-        odev->kbd_ep = NULL;
-    }
-    if(odev->mouse_ep){
-        usb_ep_disable(odev->mouse_ep);
-        odev->mouse_ep = NULL;
+        if(odev->mouse_ep != odev->kbd_ep){
+            usb_ep_disable(odev->mouse_ep);
+            if(odev->pad_ep) usb_ep_disable(odev->pad_ep);
+        }
+        odev->ep_enabled = 0;
     }
+    /* the UDC gave the queued requests back with -ESHUTDOWN */
+    reclaim_reqs(odev, &odev->kbd_pool);
+    reclaim_reqs(odev, &odev->mouse_pool);
+    reclaim_reqs(odev, &odev->pad_pool);
     odev->cur_config = 0;
+    wake_up_interruptible(&odev->room_wait);
 }
 
-static int config_buf(struct usb_gadget *gadget, u8 *buf, 
-                      u8 type, unsigned index)
+static u8 *put_blob(struct omimic_blob *blob, u8 *p, 
+                    const void *src, int len)
 {
-    int len;
+    memcpy(p, src, len);
+    blob->buf = p;
+    blob->len = len;
+    return p + len;
+}
+
+/* a top level collection, with its report ID item put in */
+static u8 *put_with_report_id(u8 *p, const u8 *desc, int len, u8 id)
+{
+    memcpy(p, desc, REPORT_ID_AT);
+    p[REPORT_ID_AT] = 0x85;  /* Report ID */
+    p[REPORT_ID_AT + 1] = id;
+    memcpy(p + REPORT_ID_AT + 2, desc + REPORT_ID_AT, len - REPORT_ID_AT);
+    return p + len + 2;
+}
+
+/* 
+ * serialize every descriptor into odev->descs. the ctrl buffer is 
+ * only used as scratch space here, to size the strings.
+ */
+static int build_desc_blobs(struct omimic_dev *odev)
+{
+    struct omimic_descs *d = &odev->descs;
+    const struct usb_config_descriptor *config;
+    const struct usb_descriptor_header **func, **h;
+    int i, id, len, cfg_len, size;
+    u8 *p;
+
+    BUILD_BUG_ON(ARRAY_SIZE(omimic_strings) != NR_STRINGS);
+    config = odev->id_len ? &comp_config : &km_config;
+    if(odev->id_len) func = comp_func;
+    else func = odev->pad_ep ? kmp_func : km_func;
+
+    cfg_len = USB_DT_CONFIG_SIZE;
+    for(h = func; *h; h++)
+        cfg_len += (*h)->bLength;
+
+    size = sizeof(omimic_dev_desc) + sizeof(omimic_dev_qualifier) 
+           + 2 * cfg_len + COMP_REPORT_DESC_SIZE;
+    for(i=0; i<NR_STRINGS; i++){
+        id = i ? omimic_strings[i-1].id : 0;
+        len = usb_gadget_get_string(&omimic_strtab, id, odev->ctrl_buf);
+        if(len < 0) return len;
+        size += len;
+    }
+
+    d->arena = kmalloc(size, GFP_KERNEL);
+    if(!d->arena) return -ENOMEM;
 
-    PDBG("config_buf --> type:%d, index:%d\n", type, index);
+    p = put_blob(&d->dev, d->arena, &omimic_dev_desc, 
+                 sizeof(omimic_dev_desc));
+    p = put_blob(&d->qualifier, p, &omimic_dev_qualifier, 
+                 sizeof(omimic_dev_qualifier));
 
-    /* currently there's only one conf */
-    if(index > 0) return -EINVAL; 
-    len = usb_gadget_config_buf(&km_config, buf, USB_BUFSIZE, km_func);
+    len = usb_gadget_config_buf(config, p, cfg_len, func);
     if(len < 0) return len;
-    ((struct usb_config_descriptor *)buf)->bDescriptorType = type;
-    return len;
+    d->config.buf = p;
+    d->config.len = len;
+    p = put_blob(&d->other_config, p + len, d->config.buf, len);
+    ((struct usb_config_descriptor *)d->other_config.buf)->bDescriptorType 
+        = USB_DT_OTHER_SPEED_CONFIG;
+
+    if(odev->id_len){
+        d->reports[KBD_INTF_NUM].buf = p;
+        p = put_with_report_id(p, kbd_report_desc, 
+                               sizeof(kbd_report_desc), REPORT_ID_KBD);
+        p = put_with_report_id(p, mouse_report_desc, 
+                               sizeof(mouse_report_desc), REPORT_ID_MOUSE);
+        if(odev->pad_ep)
+            p = put_with_report_id(p, pad_report_desc, 
+                                   sizeof(pad_report_desc), REPORT_ID_PAD);
+        d->reports[KBD_INTF_NUM].len = p - d->reports[KBD_INTF_NUM].buf;
+    }else{
+        p = put_blob(&d->reports[KBD_INTF_NUM], p, kbd_report_desc, 
+                     sizeof(kbd_report_desc));
+        p = put_blob(&d->reports[MOUSE_INTF_NUM], p, mouse_report_desc, 
+                     sizeof(mouse_report_desc));
+        if(odev->pad_ep)
+            p = put_blob(&d->reports[PAD_INTF_NUM], p, pad_report_desc, 
+                         sizeof(pad_report_desc));
+    }
+
+    for(i=0; i<NR_STRINGS; i++){
+        id = i ? omimic_strings[i-1].id : 0;
+        d->strings[i].buf = p;
+        d->strings[i].len = usb_gadget_get_string(&omimic_strtab, id, p);
+        p += d->strings[i].len;
+    }
+
+    PDBG("descriptor blobs: %d bytes\n", size);
+    return 0;
+}
+
+/* answer a GET_DESCRIPTOR right from its blob, nothing is copied */
+static int serve_blob(struct usb_request *req, const struct omimic_blob *blob,
+                      u16 w_length)
+{
+    req->buf = blob->buf;
+    return min(w_length, (u16)blob->len);
 }
 
 static int set_km_config(struct usb_gadget *gadget, unsigned gfp_flags)
@@ -827,33 +1587,51 @@ static int set_km_config(struct usb_gadget *gadget, unsigned gfp_flags)
 
     PDBG("set_km_config\n");
 
-    res = usb_ep_enable(odev->kbd_ep, &kbd_ep_desc);
-    if(res == 0){
-        PDBG("ep enabled: %s\n", odev->kbd_ep->name);
-        odev->kbd_ep->driver_data = odev;
-    }else{
-fail_enable:
+    res = usb_ep_enable(odev->kbd_ep, odev->kbd_desc);
+    if(res){
         PDBG("ep can't be enabled: %s\n", odev->kbd_ep->name);
         return res;
     }
+    PDBG("ep enabled: %s\n", odev->kbd_ep->name);
 
-    res = usb_ep_enable(odev->mouse_ep, &mouse_ep_desc);
-    if(res == 0){
+    if(odev->mouse_ep != odev->kbd_ep){  /* not composite */
+        res = usb_ep_enable(odev->mouse_ep, odev->mouse_desc);
+        if(res){
+            PDBG("ep can't be enabled: %s\n", odev->mouse_ep->name);
+            goto fail_mouse;
+        }
         PDBG("ep enabled: %s\n", odev->mouse_ep->name);
-        odev->mouse_ep->driver_data = odev;
-    }else
-        goto fail_enable;
 
+        if(odev->pad_ep){
+            res = usb_ep_enable(odev->pad_ep, odev->pad_desc);
+            if(res){
+                PDBG("ep can't be enabled: %s\n", odev->pad_ep->name);
+                goto fail_pad;
+            }
+            PDBG("ep enabled: %s\n", odev->pad_ep->name);
+        }
+    }
+
+    odev->ep_enabled = 1;
     return 0;
+
+fail_pad:
+    usb_ep_disable(odev->mouse_ep);
+fail_mouse:
+    usb_ep_disable(odev->kbd_ep);
+    return res;
 }
 
 static void intr_complete(struct usb_ep *ep, struct usb_request *req)
 {
     int status = req->status;
     struct omimic_req *oreq = req->context;
+    struct omimic_req *next = NULL;
     struct omimic_dev *odev = ep->driver_data;
+    struct omimic_node *node = NULL;
 
     PDBG("intr_complete\n");
+    atomic_dec(&oreq->pool->in_flight);
 
     switch(status){
     case 0:  /* normal completion */
@@ -861,8 +1639,43 @@ static void intr_complete(struct usb_ep *ep, struct usb_request *req)
         /* move the request to the idle list */
         spin_lock(&odev->lock);
         list_del(&oreq->list);
-        list_add(&oreq->list, &odev->idle_list);
+        list_add(&oreq->list, &oreq->pool->idle_list);
+        oreq->pool->completed++;
+        reclaim_reqs(odev, oreq->pool);
+        /* 
+         * the endpoint is ready, send the state collected meanwhile 
+         * (or lost by a failed request), or hold it until right 
+         * before the next poll.
+         */
+        if(oreq->pool == &odev->kbd_pool){
+            node = &odev->nodes[OMIMIC_MINOR_KBD];
+            sched_polled(odev, &odev->kbd_sched);
+            if(odev->kbd_dirty && !(sched_aligned 
+                   && sched_arm(&odev->kbd_sched, 
+                                odev->kbd_desc->bInterval)))
+                next = snapshot_kbd_state(odev);
+        }else if(oreq->pool == &odev->mouse_pool){
+            node = &odev->nodes[OMIMIC_MINOR_MOUSE];
+            sched_polled(odev, &odev->mouse_sched);
+            if(odev->mouse_dirty && !(sched_aligned 
+                   && sched_arm(&odev->mouse_sched, 
+                                odev->mouse_desc->bInterval)))
+                next = snapshot_mouse_state(odev);
+        }else if(oreq->pool == &odev->pad_pool){
+            node = &odev->nodes[OMIMIC_MINOR_PAD];
+            sched_polled(odev, &odev->pad_sched);
+            if(odev->pad_dirty && !(sched_aligned 
+                   && sched_arm(&odev->pad_sched, 
+                                odev->pad_desc->bInterval)))
+                next = snapshot_pad_state(odev);
+        }
+        /* tell the feeders there's room in the queue */
+        if(node && node->eventfd) eventfd_signal(node->eventfd, 1);
+        if(odev->nodes[OMIMIC_MINOR].eventfd)
+            eventfd_signal(odev->nodes[OMIMIC_MINOR].eventfd, 1);
         spin_unlock(&odev->lock);
+        wake_up_interruptible(&odev->room_wait);
+        if(next) queue_state_reqs(odev, next->pool, ep);
         break;
     default:  /* error occurs*/
         OMIMIC_PERR("%s kbd intr complete --> status:%d, actual:%d, "
@@ -871,36 +1684,42 @@ static void intr_complete(struct usb_ep *ep, struct usb_request *req)
     case -ECONNABORTED:
     case -ECONNRESET:
     case -ESHUTDOWN:
+        /* the report is dropped, the request goes back to idle_list 
+         * at the next reclaim_reqs(), which redirties a lost state */
+        set_bit(OREQ_FAILED, &oreq->flags);
+        atomic_inc(&oreq->pool->nr_failed);
         return;
     }
 }
 
-static struct usb_request *alloc_ep_req(struct usb_ep* ep, unsigned length)
-{
-    struct usb_request *req;
-    req = usb_ep_alloc_request(ep, GFP_ATOMIC);
-    if(req){
-        req->length = length;
-        req->buf = kmalloc(length, GFP_ATOMIC);
-        if(!req->buf){
-            usb_ep_free_request(ep, req);
-            req = NULL;
-        }
-    }
-    return req;
-}
-
 
 static int omimic_open(struct inode *inode, struct file *file)
 {
     struct omimic_dev *odev = container_of(inode->i_cdev, 
                                            struct omimic_dev, cdev);
-    file->private_data = odev;
+    int minor = iminor(inode) - MINOR(odev->devno);
+    struct omimic_file *ofile;
+
+    if(minor < 0 || minor >= NR_NODES) return -ENODEV;
+    if(minor == OMIMIC_MINOR_PAD && !odev->pad_ep) return -ENODEV;
+    ofile = kzalloc(sizeof(*ofile), GFP_KERNEL);
+    if(!ofile) return -ENOMEM;
+    ofile->node = &odev->nodes[minor];
+    file->private_data = ofile;
+
+    /* start with the current LED state, if the host has set one */
+    spin_lock_irq(&odev->lock);
+    file->f_pos = odev->leds_seq ? odev->leds_seq - 1 : 0;
+    spin_unlock_irq(&odev->lock);
     return 0;
 }
 
 static int omimic_release(struct inode *inode, struct file *file)
 {
+    struct omimic_node *node = file_node(file);
+
+    set_completion_eventfd(node, file, -1);
+    kfree(file->private_data);
     file->private_data = NULL;
     return 0;
 }
@@ -908,58 +1727,945 @@ static int omimic_release(struct inode *inode, struct file *file)
 static ssize_t omimic_write(struct file *file, const char __user *buf, 
                             size_t count, loff_t *pos)
 {
-    struct omimic_dev *odev = file->private_data;
+    struct omimic_node *node = file_node(file);
+    struct omimic_dev *odev = node->odev;
     struct omimic_req *oreq;
+    struct omimic_pool *pool;
     struct usb_ep *ep;
-
-    switch(count){
-    case KBD_BUFSIZE:
-        ep = odev->kbd_ep; break;
-    case MOUSE_BUFSIZE:
-        ep = odev->mouse_ep; break;
+    unsigned long flags;
+    int size, hdr = 0, ret;
+    u8 id;
+
+    /* the report sizes tell the report types apart */
+    switch(node - odev->nodes){
+    case OMIMIC_MINOR_KBD:
+        size = KBD_BUFSIZE;
+        hdr = odev->id_len;  /* the report ID is put in here */
+        break;
+    case OMIMIC_MINOR_MOUSE:
+        size = MOUSE_BUFSIZE;
+        hdr = odev->id_len;
+        break;
+    case OMIMIC_MINOR_PAD:
+        size = GAMEPAD_BUFSIZE;
+        hdr = odev->id_len;
+        break;
     default:
-        ep = NULL;
+        /* in composite mode, the reports come with their IDs */
+        if(odev->id_len){
+            if(!count) return -EINVAL;
+            if(get_user(id, (const u8 __user *)buf)) return -EFAULT;
+            switch(id){
+            case REPORT_ID_KBD: size = KBD_BUFSIZE; break;
+            case REPORT_ID_MOUSE: size = MOUSE_BUFSIZE; break;
+            case REPORT_ID_PAD: size = GAMEPAD_BUFSIZE; break;
+            default: return -EINVAL;
+            }
+        }else{
+            if(count != KBD_BUFSIZE && count != MOUSE_BUFSIZE 
+               && count != GAMEPAD_BUFSIZE)
+                return -EINVAL;
+            size = count;
+        }
+    }
+    switch(size){
+    case KBD_BUFSIZE:
+        ep = odev->kbd_ep;
+        pool = &odev->kbd_pool;
+        id = REPORT_ID_KBD;
+        break;
+    case MOUSE_BUFSIZE:
+        ep = odev->mouse_ep;
+        pool = &odev->mouse_pool;
+        id = REPORT_ID_MOUSE;
+        break;
+    default:
+        ep = odev->pad_ep;
+        pool = &odev->pad_pool;
+        id = REPORT_ID_PAD;
+        if(!ep) return -EINVAL;
     }
 
-    if(!ep) return -EINVAL;
-    
-    spin_lock(&odev->lock);
-    if(list_empty(&odev->idle_list)){
-        spin_unlock(&odev->lock);
-        return -EBUSY;
+    /* whole reports only, as the report descriptors have them */
+    if(!odev->ep_enabled || hdr + count != pool->size) 
+        return -EINVAL;
+
+    /* 
+     * reports collapse into the state while suspended, or when they 
+     * are held back until the next poll. a report that would 
+     * overwrite an unsent change pushes that change out first. 
+     */
+    if(odev->suspended || sched_aligned){
+        struct omimic_req *barrier = NULL;
+        u8 report[1 + GAMEPAD_BUFSIZE];
+        u8 *body = report + odev->id_len;
+        if(copy_from_user(report + hdr, buf, count))
+            return -EFAULT;
+        spin_lock_irqsave(&odev->lock, flags);
+        if(!odev->suspended && report_collides(odev, size, body)){
+            barrier = snapshot_state(odev, size);
+            if(!barrier){
+                spin_unlock_irqrestore(&odev->lock, flags);
+                return -EBUSY;
+            }
+        }
+        collapse_report(odev, size, body);
+        oreq = kick_state(odev, size);
+        spin_unlock_irqrestore(&odev->lock, flags);
+
+        if(barrier || oreq) queue_state_reqs(odev, pool, ep);
+        omimic_wakeup(odev);
+        return count;
     }
-    oreq = list_entry(odev->idle_list.next, struct omimic_req, list);
-    list_del(&oreq->list);
-    list_add(&oreq->list, &odev->busy_list);
-    spin_unlock(&odev->lock);
+    
+    spin_lock_irqsave(&odev->lock, flags);
+    oreq = get_idle_req(odev, pool, ep);
+    spin_unlock_irqrestore(&odev->lock, flags);
+    if(!oreq) return -EBUSY;
     /* XXX: a few bytes a time may lag the system */
-    if(copy_from_user(oreq->req->buf, buf, count)){
+    if(copy_from_user((u8 *)oreq->req->buf + hdr, buf, count)){
         OMIMIC_PERR("can't copy from user space, abort.\n");
+        put_idle_req(odev, oreq);
         return -EFAULT;
     }
+    if(hdr) *(u8 *)oreq->req->buf = id;
     oreq->req->status = 0; /* asuring */
-    oreq->req->length = count;
+    oreq->req->length = hdr + count;
     oreq->req->zero = 0;
-    usb_ep_queue(ep, oreq->req, GFP_KERNEL);
+    atomic_inc(&pool->in_flight);
+    ret = usb_ep_queue(ep, oreq->req, GFP_KERNEL);
+    if(ret){
+        atomic_dec(&pool->in_flight);
+        put_idle_req(odev, oreq);
+        return ret;
+    }
+    if(odev->suspended) omimic_wakeup(odev);
 
     return count;
 }
 
-static int populate_req_list(struct list_head *head, struct usb_ep *ep, 
-                             void *complete, int size, int nr)
+/* 
+ * read the LED reports, one byte each, oldest first. a reader that 
+ * falls behind by more than NR_LED_REPORTS loses the oldest ones.
+ */
+static ssize_t omimic_read(struct file *file, char __user *buf, 
+                           size_t count, loff_t *pos)
+{
+    struct omimic_node *node = file_node(file);
+    struct omimic_dev *odev = node->odev;
+    u8 leds[NR_LED_REPORTS];
+    unsigned seq, next, n, i;
+    unsigned long flags;
+
+    /* only the kbd has output reports */
+    if(node != &odev->nodes[OMIMIC_MINOR] 
+       && node != &odev->nodes[OMIMIC_MINOR_KBD])
+        return -EINVAL;
+    if(!count) return 0;
+
+    for(;;){
+        spin_lock_irqsave(&odev->lock, flags);
+        seq = odev->leds_seq;
+        next = (unsigned)*pos;
+        if(seq != next) break;
+        spin_unlock_irqrestore(&odev->lock, flags);
+
+        if(file->f_flags & O_NONBLOCK) return -EAGAIN;
+        if(wait_event_interruptible(odev->leds_wait, 
+                                    odev->leds_seq != (unsigned)*pos))
+            return -ERESTARTSYS;
+    }
+
+    if(seq - next > NR_LED_REPORTS) next = seq - NR_LED_REPORTS;
+    n = min_t(unsigned, count, seq - next);
+    for(i=0; i<n; i++)
+        leds[i] = odev->leds[(next + i) % NR_LED_REPORTS];
+    spin_unlock_irqrestore(&odev->lock, flags);
+
+    if(copy_to_user(buf, leds, n)) return -EFAULT;
+    *pos = next + n;
+    return n;
+}
+
+/* 
+ * writable when a write would find a request for its report, on every 
+ * endpoint for /dev/omimic. a write that fails right away (not 
+ * configured), or collapses into the state, doesn't have to wait.
+ */
+static unsigned int omimic_poll(struct file *file, poll_table *wait)
+{
+    struct omimic_node *node = file_node(file);
+    struct omimic_dev *odev = node->odev;
+    unsigned int mask = 0;
+    unsigned long flags;
+    int room;
+
+    poll_wait(file, &odev->room_wait, wait);
+    spin_lock_irqsave(&odev->lock, flags);
+    if(!odev->ep_enabled || odev->suspended || sched_aligned)
+        room = 1;
+    else if(node == &odev->nodes[OMIMIC_MINOR_KBD])
+        room = pool_has_room(odev, &odev->kbd_pool);
+    else if(node == &odev->nodes[OMIMIC_MINOR_MOUSE])
+        room = pool_has_room(odev, &odev->mouse_pool);
+    else if(node == &odev->nodes[OMIMIC_MINOR_PAD])
+        room = pool_has_room(odev, &odev->pad_pool);
+    else
+        room = pool_has_room(odev, &odev->kbd_pool) 
+            && pool_has_room(odev, &odev->mouse_pool) 
+            && (!odev->pad_ep || pool_has_room(odev, &odev->pad_pool));
+    spin_unlock_irqrestore(&odev->lock, flags);
+    if(room) mask |= POLLOUT | POLLWRNORM;
+
+    if(node != &odev->nodes[OMIMIC_MINOR] 
+       && node != &odev->nodes[OMIMIC_MINOR_KBD])
+        return mask;
+
+    poll_wait(file, &odev->leds_wait, wait);
+    if(odev->leds_seq != (unsigned)file->f_pos)
+        mask |= POLLIN | POLLRDNORM;
+    return mask;
+}
+
+/* 
+ * splice a stream of raw kbd reports (e.g. a recorded file) straight
+ * into request buffers, so that no userspace buffer is involved.
+ * a report may span two pipe buffers, the part in the earlier one is 
+ * kept in the file between actor calls.
+ */
+static ssize_t omimic_splice_write(struct pipe_inode_info *pipe, 
+                                   struct file *out, loff_t *ppos, 
+                                   size_t len, unsigned int flags)
+{
+    struct omimic_node *node = file_node(out);
+    struct omimic_dev *odev = node->odev;
+    ssize_t ret;
+
+    if(!odev->ep_enabled || (node != &odev->nodes[OMIMIC_MINOR] 
+                         && node != &odev->nodes[OMIMIC_MINOR_KBD]))
+        return -EINVAL;
+
+    mutex_lock(&odev->splice_mutex);
+    ret = splice_from_pipe(pipe, out, ppos, len, flags, 
+                           omimic_splice_actor);
+    mutex_unlock(&odev->splice_mutex);
+
+    return ret;
+}
+
+static int omimic_splice_actor(struct pipe_inode_info *pipe, 
+                               struct pipe_buffer *buf, 
+                               struct splice_desc *sd)
+{
+    struct omimic_file *ofile = sd->u.file->private_data;
+    struct omimic_dev *odev = ofile->node->odev;
+    unsigned done = 0, n;
+    char *data;
+    int ret;
+
+    if(!odev->ep_enabled) return -ESHUTDOWN;
+
+    ret = buf->ops->confirm(pipe, buf);
+    if(ret) return ret;
+
+    data = buf->ops->map(pipe, buf, 0);
+    while(done < sd->len){
+        n = min(KBD_BUFSIZE - ofile->splice_len, sd->len - done);
+        memcpy(ofile->splice_buf + ofile->splice_len, 
+               data + buf->offset + done, n);
+        if(ofile->splice_len + n < KBD_BUFSIZE){
+            /* the rest is in the next buffer */
+            ofile->splice_len += n;
+            done += n;
+            break;
+        }
+
+        /* if the report is not taken, neither are the bytes from 
+         * this buffer: a short count (or the error if none left) 
+         * gets them again. the part from an earlier one stays put */
+        ret = splice_report(odev, ofile->splice_buf);
+        if(ret) break;
+        ofile->splice_len = 0;
+        done += n;
+    }
+    buf->ops->unmap(pipe, buf, data);
+
+    return done ? done : ret;
+}
+
+/* send one spliced kbd report, or collapse it into the state */
+static int splice_report(struct omimic_dev *odev, const u8 *report)
+{
+    struct omimic_req *oreq;
+    struct usb_ep *ep = odev->kbd_ep;
+    unsigned long flags;
+    int ret;
+
+    spin_lock_irqsave(&odev->lock, flags);
+    if(odev->suspended){
+        collapse_report(odev, KBD_BUFSIZE, report);
+        spin_unlock_irqrestore(&odev->lock, flags);
+        omimic_wakeup(odev);
+        return 0;
+    }
+    oreq = get_idle_req(odev, &odev->kbd_pool, ep);
+    spin_unlock_irqrestore(&odev->lock, flags);
+    if(!oreq) return -EBUSY;
+
+    if(odev->id_len) *(u8 *)oreq->req->buf = REPORT_ID_KBD;
+    memcpy((u8 *)oreq->req->buf + odev->id_len, report, KBD_BUFSIZE);
+    oreq->req->status = 0;
+    oreq->req->length = odev->kbd_pool.size;
+    oreq->req->zero = 0;
+    atomic_inc(&odev->kbd_pool.in_flight);
+    ret = usb_ep_queue(ep, oreq->req, GFP_KERNEL);
+    if(ret){
+        atomic_dec(&odev->kbd_pool.in_flight);
+        put_idle_req(odev, oreq);
+    }
+    return ret;
+}
+
+static long omimic_ioctl(struct file *file, unsigned int cmd, 
+                         unsigned long arg)
+{
+    struct omimic_node *node = file_node(file);
+    struct omimic_dev *odev = node->odev;
+    struct omimic_event_batch batch;
+    struct omimic_event evs[NR_EVENTS_CHUNK];
+    struct omimic_event __user *uevs;
+    struct omimic_queue_stats stats;
+    unsigned long flags;
+    unsigned i, n, done = 0;
+    int fd, ret = 0;
+
+    switch(cmd){
+    case OMIMIC_IOC_EVENTS:
+        if(copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+            return -EFAULT;
+        uevs = (struct omimic_event __user *)(unsigned long)batch.events;
+        while(done < batch.nr){
+            n = min_t(unsigned, batch.nr - done, NR_EVENTS_CHUNK);
+            if(copy_from_user(evs, uevs + done, n * sizeof(evs[0]))){
+                ret = -EFAULT;
+                break;
+            }
+            for(i=0; i<n; i++){
+                ret = omimic_event(odev, &evs[i]);
+                if(ret) break;
+            }
+            done += i;
+            if(ret) break;
+        }
+        return done ? done : ret;
+    case OMIMIC_IOC_QUEUE_STATS:
+        spin_lock_irqsave(&odev->lock, flags);
+        get_ep_stats(odev, &odev->kbd_pool, &stats.ep[OMIMIC_EP_KBD]);
+        get_ep_stats(odev, &odev->mouse_pool, &stats.ep[OMIMIC_EP_MOUSE]);
+        get_ep_stats(odev, &odev->pad_pool, &stats.ep[OMIMIC_EP_PAD]);
+        spin_unlock_irqrestore(&odev->lock, flags);
+        if(copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+            return -EFAULT;
+        return 0;
+    case OMIMIC_IOC_COMPLETION_EVENTFD:
+        if(get_user(fd, (int __user *)arg))
+            return -EFAULT;
+        return set_completion_eventfd(node, file, fd);
+    default:
+        return -ENOTTY;
+    }
+}
+
+/* must be called with odev->lock held */
+static void get_ep_stats(struct omimic_dev *odev, struct omimic_pool *pool, 
+                         struct omimic_ep_stats *stats)
+{
+    struct omimic_req *oreq;
+
+    memset(stats, 0, sizeof(*stats));
+    reclaim_reqs(odev, pool);
+    list_for_each_entry(oreq, &pool->idle_list, list)
+        stats->idle++;
+    list_for_each_entry(oreq, &pool->busy_list, list)
+        stats->busy++;
+    stats->in_flight = atomic_read(&pool->in_flight);
+    stats->completed = pool->completed;
+}
+
+/* 
+ * replace the eventfd of the node, fd < 0 drops it. when dropping, 
+ * only the file that set the eventfd can do it.
+ */
+static int set_completion_eventfd(struct omimic_node *node, 
+                                  struct file *file, int fd)
+{
+    struct omimic_dev *odev = node->odev;
+    struct file *efile = NULL, *old;
+    unsigned long flags;
+
+    if(fd >= 0){
+        efile = eventfd_fget(fd);
+        if(IS_ERR(efile)) return PTR_ERR(efile);
+    }
+
+    spin_lock_irqsave(&odev->lock, flags);
+    old = node->eventfd;
+    if(efile || node->eventfd_owner == file){
+        node->eventfd = efile;
+        node->eventfd_owner = efile ? file : NULL;
+    }else
+        old = NULL;
+    spin_unlock_irqrestore(&odev->lock, flags);
+
+    if(old) fput(old);
+    return 0;
+}
+
+/* 
+ * apply one event to the kbd/mouse state. the report is assembled 
+ * right away if nothing is in flight on the endpoint, otherwise it 
+ * is left to intr_complete(), so the events between two polls 
+ * collapse into one report.
+ */
+static int omimic_event(struct omimic_dev *odev, const struct omimic_event *ev)
+{
+    struct omimic_req *barrier = NULL, *oreq = NULL;
+    struct usb_ep *ep;
+    unsigned long flags;
+    int i, ret = 0;
+    u16 mask16, btns;
+    u8 mask;
+
+    spin_lock_irqsave(&odev->lock, flags);
+    switch(ev->op){
+    case OMIMIC_EV_KEY_DOWN:
+    case OMIMIC_EV_KEY_UP:
+        ep = odev->kbd_ep;
+        /* the usages in the report descriptor: keys up to its 
+         * Logical Maximum, and the modifiers */
+        if(!odev->ep_enabled || !ev->code 
+           || (ev->code > 0x65 && ev->code < 0xe0) || ev->code > 0xe7){
+            ret = -EINVAL;
+            break;
+        }
+        if(test_bit(ev->code, odev->kbd_touched) && !odev->suspended){
+            barrier = snapshot_kbd_state(odev);
+            if(!barrier){
+                ret = -EBUSY;
+                break;
+            }
+        }
+        __set_bit(ev->code, odev->kbd_touched);
+
+        if(ev->code >= 0xe0 && ev->code <= 0xe7){
+            mask = 1 << (ev->code - 0xe0);
+            if(ev->op == OMIMIC_EV_KEY_DOWN)
+                odev->kbd_state[0] |= mask;
+            else
+                odev->kbd_state[0] &= ~mask;
+        }else if(ev->op == OMIMIC_EV_KEY_DOWN){
+            for(i=2; i<2+NR_KBD_KEYS && odev->kbd_state[i] 
+                     && odev->kbd_state[i] != ev->code; i++);
+            /* no rollover, drop the key when all slots are taken */
+            if(i < 2+NR_KBD_KEYS) odev->kbd_state[i] = ev->code;
+        }else{
+            for(i=2; i<2+NR_KBD_KEYS 
+                     && odev->kbd_state[i] != ev->code; i++);
+            if(i < 2+NR_KBD_KEYS){
+                for(; i<1+NR_KBD_KEYS; i++)
+                    odev->kbd_state[i] = odev->kbd_state[i+1];
+                odev->kbd_state[i] = 0;
+            }
+        }
+        odev->kbd_dirty = 1;
+        oreq = kick_kbd_state(odev);
+        break;
+    case OMIMIC_EV_BTN_DOWN:
+    case OMIMIC_EV_BTN_UP:
+    case OMIMIC_EV_MOUSE_MOVE:
+        ep = odev->mouse_ep;
+        if(!odev->ep_enabled){
+            ret = -EINVAL;
+            break;
+        }
+        if(ev->op == OMIMIC_EV_MOUSE_MOVE){
+            switch(ev->code){
+            case OMIMIC_AXIS_X: odev->mouse_dx += ev->value; break;
+            case OMIMIC_AXIS_Y: odev->mouse_dy += ev->value; break;
+            case OMIMIC_AXIS_WHEEL: odev->mouse_wheel += ev->value; break;
+            default: ret = -EINVAL;
+            }
+        }else if(ev->code < NR_MOUSE_BTNS){
+            mask = 1 << ev->code;
+            if((odev->mouse_touched & mask) && !odev->suspended){
+                barrier = snapshot_mouse_state(odev);
+                if(!barrier){
+                    ret = -EBUSY;
+                    break;
+                }
+            }
+            odev->mouse_touched |= mask;
+            if(ev->op == OMIMIC_EV_BTN_DOWN)
+                odev->mouse_btns |= mask;
+            else
+                odev->mouse_btns &= ~mask;
+        }else
+            ret = -EINVAL;
+        if(ret) break;
+        odev->mouse_dirty = 1;
+        oreq = kick_mouse_state(odev);
+        break;
+    case OMIMIC_EV_PAD_BTN_DOWN:
+    case OMIMIC_EV_PAD_BTN_UP:
+    case OMIMIC_EV_PAD_AXIS:
+        ep = odev->pad_ep;
+        if(!odev->ep_enabled || !ep){
+            ret = -EINVAL;
+            break;
+        }
+        if(ev->op == OMIMIC_EV_PAD_AXIS){
+            /* absolute, the latest value wins */
+            if(ev->code < NR_PAD_AXES){
+                mask16 = max_t(s16, ev->value, -32767);
+                odev->pad_state[3 + 2 * ev->code] = mask16 & 0xff;
+                odev->pad_state[4 + 2 * ev->code] = mask16 >> 8;
+            }else if(ev->code == OMIMIC_PAD_HAT)
+                odev->pad_state[2] = (ev->value >= 0 && ev->value < 8) ? 
+                    ev->value : PAD_HAT_NULL;
+            else
+                ret = -EINVAL;
+        }else if(ev->code < NR_PAD_BTNS){
+            mask16 = 1 << ev->code;
+            if((odev->pad_touched & mask16) && !odev->suspended){
+                barrier = snapshot_pad_state(odev);
+                if(!barrier){
+                    ret = -EBUSY;
+                    break;
+                }
+            }
+            odev->pad_touched |= mask16;
+            btns = odev->pad_state[0] | (odev->pad_state[1] << 8);
+            if(ev->op == OMIMIC_EV_PAD_BTN_DOWN)
+                btns |= mask16;
+            else
+                btns &= ~mask16;
+            odev->pad_state[0] = btns & 0xff;
+            odev->pad_state[1] = btns >> 8;
+        }else
+            ret = -EINVAL;
+        if(ret) break;
+        odev->pad_dirty = 1;
+        oreq = kick_pad_state(odev);
+        break;
+    default:
+        ep = NULL;
+        ret = -EINVAL;
+    }
+    spin_unlock_irqrestore(&odev->lock, flags);
+
+    if(barrier || oreq) 
+        queue_state_reqs(odev, (barrier ? barrier : oreq)->pool, ep);
+    if(!ret) omimic_wakeup(odev);
+
+    return ret;
+}
+
+/* 
+ * assemble a report from the state into an idle request, which goes 
+ * to the pool's queue_list: queue_state_reqs() hands it to the UDC 
+ * after the lock is dropped. must be called with odev->lock held.
+ */
+static struct omimic_req *snapshot_kbd_state(struct omimic_dev *odev)
+{
+    struct omimic_req *oreq;
+    u8 *buf;
+
+    oreq = get_idle_req(odev, &odev->kbd_pool, odev->kbd_ep);
+    if(!oreq) return NULL;
+
+    buf = oreq->req->buf;
+    if(odev->id_len) *buf++ = REPORT_ID_KBD;
+    memcpy(buf, odev->kbd_state, KBD_BUFSIZE);
+    oreq->req->length = odev->id_len + KBD_BUFSIZE;
+    list_add_tail(&oreq->queue, &odev->kbd_pool.queue_list);
+    set_bit(OREQ_STATE, &oreq->flags);
+    bitmap_zero(odev->kbd_touched, 256);
+    odev->kbd_dirty = 0;
+    return oreq;
+}
+
+static struct omimic_req *snapshot_mouse_state(struct omimic_dev *odev)
+{
+    struct omimic_req *oreq;
+    u8 *buf;
+    int dx, dy, dw;
+
+    oreq = get_idle_req(odev, &odev->mouse_pool, odev->mouse_ep);
+    if(!oreq) return NULL;
+
+    /* motion beyond the report range is carried to the next report */
+    dx = clamp_t(int, odev->mouse_dx, -127, 127);
+    dy = clamp_t(int, odev->mouse_dy, -127, 127);
+    dw = clamp_t(int, odev->mouse_wheel, -127, 127);
+    odev->mouse_dx -= dx;
+    odev->mouse_dy -= dy;
+    odev->mouse_wheel -= dw;
+
+    buf = oreq->req->buf;
+    if(odev->id_len) *buf++ = REPORT_ID_MOUSE;
+    buf[0] = odev->mouse_btns;
+    buf[1] = (s8)dx;
+    buf[2] = (s8)dy;
+    buf[3] = (s8)dw;
+    oreq->req->length = odev->id_len + MOUSE_BUFSIZE;
+    list_add_tail(&oreq->queue, &odev->mouse_pool.queue_list);
+    set_bit(OREQ_STATE, &oreq->flags);
+    odev->mouse_touched = 0;
+    odev->mouse_dirty = odev->mouse_dx || odev->mouse_dy || odev->mouse_wheel;
+    return oreq;
+}
+
+static struct omimic_req *snapshot_pad_state(struct omimic_dev *odev)
+{
+    struct omimic_req *oreq;
+    u8 *buf;
+
+    oreq = get_idle_req(odev, &odev->pad_pool, odev->pad_ep);
+    if(!oreq) return NULL;
+
+    buf = oreq->req->buf;
+    if(odev->id_len) *buf++ = REPORT_ID_PAD;
+    memcpy(buf, odev->pad_state, GAMEPAD_BUFSIZE);
+    oreq->req->length = odev->id_len + GAMEPAD_BUFSIZE;
+    list_add_tail(&oreq->queue, &odev->pad_pool.queue_list);
+    set_bit(OREQ_STATE, &oreq->flags);
+    odev->pad_touched = 0;
+    odev->pad_dirty = 0;
+    return oreq;
+}
+
+/* the snapshot of the report type of this size */
+static struct omimic_req *snapshot_state(struct omimic_dev *odev, int size)
+{
+    switch(size){
+    case KBD_BUFSIZE: return snapshot_kbd_state(odev);
+    case MOUSE_BUFSIZE: return snapshot_mouse_state(odev);
+    default: return snapshot_pad_state(odev);
+    }
+}
+
+/* fold a whole report into the state. 
+ * must be called with odev->lock held. */
+static void collapse_report(struct omimic_dev *odev, int size, 
+                            const u8 *report)
+{
+    if(size == KBD_BUFSIZE){
+        memcpy(odev->kbd_state, report, KBD_BUFSIZE);
+        bitmap_zero(odev->kbd_touched, 256);
+        odev->kbd_dirty = 1;
+    }else if(size == GAMEPAD_BUFSIZE){
+        odev->pad_touched |= (report[0] ^ odev->pad_state[0]) 
+                             | ((report[1] ^ odev->pad_state[1]) << 8);
+        memcpy(odev->pad_state, report, GAMEPAD_BUFSIZE);
+        odev->pad_dirty = 1;
+    }else{
+        odev->mouse_touched |= report[0] ^ odev->mouse_btns;
+        odev->mouse_btns = report[0];
+        odev->mouse_dx += (s8)report[1];
+        odev->mouse_dy += (s8)report[2];
+        odev->mouse_wheel += (s8)report[3];
+        odev->mouse_dirty = 1;
+    }
+}
+
+/* would folding the report into the state lose an unsent change? 
+ * must be called with odev->lock held. */
+static int report_collides(struct omimic_dev *odev, int size, 
+                           const u8 *report)
+{
+    if(size == KBD_BUFSIZE)
+        return odev->kbd_dirty;
+    if(size == GAMEPAD_BUFSIZE)
+        return (((report[0] ^ odev->pad_state[0]) 
+                 | ((report[1] ^ odev->pad_state[1]) << 8)) 
+                & odev->pad_touched) != 0;
+    return (report[0] ^ odev->mouse_btns) & odev->mouse_touched;
+}
+
+/* 
+ * the state changed: assemble the report right away if nothing is in 
+ * flight on the endpoint, unless it is held for the next poll. with 
+ * something in flight, it is left to intr_complete(). 
+ * must be called with odev->lock held.
+ */
+static struct omimic_req *kick_kbd_state(struct omimic_dev *odev)
+{
+    reclaim_reqs(odev, &odev->kbd_pool);
+    if(odev->suspended || !list_empty(&odev->kbd_pool.busy_list))
+        return NULL;
+    if(sched_aligned 
+       && sched_arm(&odev->kbd_sched, odev->kbd_desc->bInterval))
+        return NULL;
+    return snapshot_kbd_state(odev);
+}
+
+static struct omimic_req *kick_mouse_state(struct omimic_dev *odev)
+{
+    reclaim_reqs(odev, &odev->mouse_pool);
+    if(odev->suspended || !list_empty(&odev->mouse_pool.busy_list))
+        return NULL;
+    if(sched_aligned 
+       && sched_arm(&odev->mouse_sched, odev->mouse_desc->bInterval))
+        return NULL;
+    return snapshot_mouse_state(odev);
+}
+
+static struct omimic_req *kick_pad_state(struct omimic_dev *odev)
+{
+    reclaim_reqs(odev, &odev->pad_pool);
+    if(odev->suspended || !list_empty(&odev->pad_pool.busy_list))
+        return NULL;
+    if(sched_aligned 
+       && sched_arm(&odev->pad_sched, odev->pad_desc->bInterval))
+        return NULL;
+    return snapshot_pad_state(odev);
+}
+
+static struct omimic_req *kick_state(struct omimic_dev *odev, int size)
+{
+    switch(size){
+    case KBD_BUFSIZE: return kick_kbd_state(odev);
+    case MOUSE_BUFSIZE: return kick_mouse_state(odev);
+    default: return kick_pad_state(odev);
+    }
+}
+
+static void sched_init(struct omimic_dev *odev, struct omimic_sched *sched)
+{
+    hrtimer_init(&sched->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    sched->timer.function = omimic_sched_timer;
+    sched->odev = odev;
+    sched->last_frame = -1;
+    sched->frame_ns = FRAME_NS;
+    sched->synced = 0;
+}
+
+/* 
+ * a report completed, i.e. the host polled just now. 
+ * must be called with odev->lock held.
+ */
+static void sched_polled(struct omimic_dev *odev, struct omimic_sched *sched)
+{
+    ktime_t now = ktime_get();
+    int frame = usb_gadget_frame_number(odev->gadget);
+    int frames;
+    s64 ns;
+
+    /* 
+     * the frame counter tells how many host frames passed since the 
+     * last poll, which measures a frame in local time: the two clocks 
+     * drift apart, enough to matter over long idle periods.
+     */
+    if(sched->synced && frame >= 0 && sched->last_frame >= 0){
+        frames = (frame - sched->last_frame) & (NR_FRAMES - 1);
+        ns = ktime_to_ns(ktime_sub(now, sched->last_poll));
+        if(frames && ns < (s64)FRAME_NS * (NR_FRAMES - 1)){
+            ns = div_s64(ns, frames);
+            if(ns > FRAME_NS - FRAME_NS / 16 && ns < FRAME_NS + FRAME_NS / 16)
+                sched->frame_ns += ((int)ns - sched->frame_ns) / 8;
+        }
+    }
+
+    sched->last_poll = now;
+    sched->last_frame = frame;
+    sched->synced = 1;
+}
+
+/* 
+ * arm the timer to assemble the report sched_lead_us before the next 
+ * poll. returns 0 if the poll phase is not known, and the report 
+ * should be sent right away. must be called with odev->lock held.
+ */
+static int sched_arm(struct omimic_sched *sched, int interval)
+{
+    s64 period, lead, since;
+    ktime_t now;
+
+    if(!sched->synced) return 0;
+    if(hrtimer_active(&sched->timer)) return 1;
+
+    period = (s64)sched->frame_ns * interval;
+    lead = clamp_t(s64, (s64)sched_lead_us * 1000, 0, period);
+    now = ktime_get();
+    since = ktime_to_ns(ktime_sub(now, sched->last_poll));
+
+    /* too long ago, the phase can't be trusted anymore */
+    if(since > (s64)sched->frame_ns * (NR_FRAMES - 1)){
+        sched->synced = 0;
+        return 0;
+    }
+
+    since = div_s64(since + lead, (s32)period) + 1;
+    hrtimer_start(&sched->timer, 
+                  ktime_add_ns(sched->last_poll, since * period - lead), 
+                  HRTIMER_MODE_ABS);
+    return 1;
+}
+
+/* runs in hardirq context */
+static enum hrtimer_restart omimic_sched_timer(struct hrtimer *timer)
+{
+    struct omimic_sched *sched = container_of(timer, struct omimic_sched, 
+                                              timer);
+    struct omimic_dev *odev = sched->odev;
+    struct omimic_req *oreq = NULL;
+    struct usb_ep *ep;
+    unsigned long flags;
+
+    spin_lock_irqsave(&odev->lock, flags);
+    if(sched == &odev->kbd_sched){
+        ep = odev->kbd_ep;
+        if(odev->ep_enabled && odev->kbd_dirty && !odev->suspended)
+            oreq = snapshot_kbd_state(odev);
+    }else if(sched == &odev->mouse_sched){
+        ep = odev->mouse_ep;
+        if(odev->ep_enabled && odev->mouse_dirty && !odev->suspended)
+            oreq = snapshot_mouse_state(odev);
+    }else{
+        ep = odev->pad_ep;
+        if(odev->ep_enabled && odev->pad_dirty && !odev->suspended)
+            oreq = snapshot_pad_state(odev);
+    }
+    spin_unlock_irqrestore(&odev->lock, flags);
+
+    if(oreq) queue_state_reqs(odev, oreq->pool, ep);
+    return HRTIMER_NORESTART;
+}
+
+/* input while suspended, wake the host up if it allows us to */
+static void omimic_wakeup(struct omimic_dev *odev)
+{
+    unsigned long flags;
+    int wake, ret;
+
+    spin_lock_irqsave(&odev->lock, flags);
+    wake = odev->suspended && odev->remote_wakeup && !odev->wakeup_pending;
+    if(wake) odev->wakeup_pending = 1;
+    spin_unlock_irqrestore(&odev->lock, flags);
+
+    if(wake){
+        ret = usb_gadget_wakeup(odev->gadget);
+        PDBG("usb_gadget_wakeup --> ret:%d\n", ret);
+        if(ret){
+            spin_lock_irqsave(&odev->lock, flags);
+            odev->wakeup_pending = 0;
+            spin_unlock_irqrestore(&odev->lock, flags);
+        }
+    }
+}
+
+/* 
+ * hand the state snapshots of the pool to the UDC, oldest first. a 
+ * caller that finds the pool draining leaves its snapshots to the one 
+ * draining it. a snapshot the UDC refuses goes back into the state, 
+ * which is kicked once more. must be called without odev->lock held.
+ */
+static void queue_state_reqs(struct omimic_dev *odev, 
+                             struct omimic_pool *pool, struct usb_ep *ep)
+{
+    struct omimic_req *oreq;
+    unsigned long flags;
+    int ret, failed = 0, kicked = 0;
+
+    spin_lock_irqsave(&odev->lock, flags);
+    if(pool->draining){
+        spin_unlock_irqrestore(&odev->lock, flags);
+        return;
+    }
+    pool->draining = 1;
+again:
+    while(!list_empty(&pool->queue_list)){
+        oreq = list_entry(pool->queue_list.next, struct omimic_req, queue);
+        list_del(&oreq->queue);
+        spin_unlock_irqrestore(&odev->lock, flags);
+
+        oreq->req->status = 0;
+        oreq->req->zero = 0;
+        atomic_inc(&pool->in_flight);
+        ret = usb_ep_queue(ep, oreq->req, GFP_ATOMIC);
+
+        spin_lock_irqsave(&odev->lock, flags);
+        if(ret){
+            atomic_dec(&pool->in_flight);
+            list_del(&oreq->list);
+            list_add(&oreq->list, &pool->idle_list);
+            restore_state(odev, oreq);
+            failed = 1;
+        }
+    }
+    /* with nothing else in flight, no completion would send it */
+    if(failed && !kicked && odev->ep_enabled){
+        kicked = 1;
+        if(kick_state(odev, pool->size - odev->id_len)) goto again;
+    }
+    pool->draining = 0;
+    spin_unlock_irqrestore(&odev->lock, flags);
+}
+
+/* 
+ * the report of a state snapshot was not sent: the state is dirty 
+ * again, and the motion it carried is due once more. 
+ * must be called with odev->lock held.
+ */
+static void restore_state(struct omimic_dev *odev, struct omimic_req *oreq)
+{
+    u8 *buf = (u8 *)oreq->req->buf + odev->id_len;
+
+    if(oreq->pool == &odev->kbd_pool){
+        odev->kbd_dirty = 1;
+    }else if(oreq->pool == &odev->mouse_pool){
+        odev->mouse_dx += (s8)buf[1];
+        odev->mouse_dy += (s8)buf[2];
+        odev->mouse_wheel += (s8)buf[3];
+        odev->mouse_dirty = 1;
+    }else
+        odev->pad_dirty = 1;
+}
+
+static int populate_req_pool(struct omimic_pool *pool, struct usb_ep *ep, 
+                             void *complete, int size, int nr_slots, 
+                             int nr_min, int nr)
 {
     int i;
+    unsigned slots_size = 
+        L1_CACHE_ALIGN(nr_slots * sizeof(struct omimic_req));
+    unsigned buf_size = L1_CACHE_ALIGN(size);
     struct omimic_req *oreq;
 
+    /* every report buffer starts on its own cache line, so that no 
+     * two buffers share a line when the UDC does DMA on them */
+    pool->arena = kzalloc(slots_size + nr_slots * buf_size, GFP_KERNEL);
+    if(!pool->arena){
+        OMIMIC_PERR("can't allocate request arena, abort\n");
+        return -ENOMEM;
+    }
+    pool->complete = complete;
+    pool->size = size;
+    pool->nr_slots = nr_slots;
+    pool->nr_min = nr_min;
+
+    for(i=0; i<nr_slots; i++){
+        oreq = (struct omimic_req *)pool->arena + i;
+        oreq->pool = pool;
+        oreq->buf = (u8 *)pool->arena + slots_size + i * buf_size;
+        list_add_tail(&oreq->list, &pool->free_list);
+    }
+
     for(i=0; i<nr; i++){
-        oreq = kmalloc(sizeof(*oreq), GFP_KERNEL);
-        if(!oreq)
-            goto check_list;
-        oreq->req = alloc_ep_req(ep, size);
+        oreq = list_entry(pool->free_list.next, struct omimic_req, list);
+        oreq->req = usb_ep_alloc_request(ep, GFP_KERNEL);
         if(!oreq->req){
-            kfree(oreq);
-check_list:  
-            if(list_empty(head)){
+            if(i == 0){
                 OMIMIC_PERR("can't allocate any request buffer, abort\n");
                 return -ENOMEM;
             }else{
@@ -967,14 +2673,162 @@ check_list:
                 break;
             }
         }
+        oreq->req->buf = oreq->buf;
         oreq->req->complete = complete;
         oreq->req->context = oreq;
         oreq->req->length = size;
         oreq->req->zero = 0;
-        list_add(&oreq->list, head);
+        list_del(&oreq->list);
+        list_add_tail(&oreq->list, &pool->idle_list);
+        pool->nr_req++;
         PDBG("request buffer added to idle list\n");
     }
 
     return 0;
 }
 
+static void free_req_pool(struct omimic_pool *pool, struct usb_ep *ep)
+{
+    int i;
+    struct omimic_req *oreq;
+
+    if(!pool->arena) return;
+
+    for(i=0; i<pool->nr_slots; i++){
+        oreq = (struct omimic_req *)pool->arena + i;
+        if(oreq->req) usb_ep_free_request(ep, oreq->req);
+    }
+    kfree(pool->arena);
+    pool->arena = NULL;
+    pool->nr_slots = 0;
+    pool->nr_req = 0;
+    INIT_LIST_HEAD(&pool->idle_list);
+    INIT_LIST_HEAD(&pool->busy_list);
+    INIT_LIST_HEAD(&pool->free_list);
+}
+
+/* 
+ * take a request from the idle list and put it in the busy list. 
+ * an adaptive pool that runs dry grows by one request, up to nr_slots. 
+ * must be called with odev->lock held.
+ */
+static struct omimic_req *get_idle_req(struct omimic_dev *odev, 
+                                       struct omimic_pool *pool, 
+                                       struct usb_ep *ep)
+{
+    struct omimic_req *oreq;
+
+    if(list_empty(&pool->idle_list)) reclaim_reqs(odev, pool);
+    if(list_empty(&pool->idle_list)){
+        if(!pool_adaptive) return NULL;
+
+        /* under pressure, postpone the shrinking */
+        mod_timer(&odev->pool_timer, 
+                  jiffies + msecs_to_jiffies(pool_idle_ms));
+        if(list_empty(&pool->free_list)) return NULL;
+
+        oreq = list_entry(pool->free_list.next, struct omimic_req, list);
+        oreq->req = usb_ep_alloc_request(ep, GFP_ATOMIC);
+        if(!oreq->req) return NULL;
+        oreq->req->buf = oreq->buf;
+        oreq->req->complete = pool->complete;
+        oreq->req->context = oreq;
+        oreq->req->length = pool->size;
+        oreq->req->zero = 0;
+        pool->nr_req++;
+        PDBG("request pool grown to %d\n", pool->nr_req);
+    }else
+        oreq = list_entry(pool->idle_list.next, struct omimic_req, list);
+
+    clear_bit(OREQ_STATE, &oreq->flags);
+    list_del(&oreq->list);
+    list_add(&oreq->list, &pool->busy_list);
+    return oreq;
+}
+
+/* would get_idle_req() find a request? 
+ * must be called with odev->lock held. */
+static int pool_has_room(struct omimic_dev *odev, struct omimic_pool *pool)
+{
+    reclaim_reqs(odev, pool);
+    return !list_empty(&pool->idle_list) 
+        || (pool_adaptive && !list_empty(&pool->free_list));
+}
+
+/* give back a request taken by get_idle_req() but never queued */
+static void put_idle_req(struct omimic_dev *odev, struct omimic_req *oreq)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&odev->lock, flags);
+    list_del(&oreq->list);
+    list_add(&oreq->list, &oreq->pool->idle_list);
+    spin_unlock_irqrestore(&odev->lock, flags);
+}
+
+/* 
+ * move the requests flagged by a failed completion back to idle_list. 
+ * a lost state snapshot makes the state dirty again, for the kick or 
+ * the completion that comes next. must be called with odev->lock held.
+ */
+static void reclaim_reqs(struct omimic_dev *odev, struct omimic_pool *pool)
+{
+    struct omimic_req *oreq, *n;
+
+    if(!atomic_read(&pool->nr_failed)) return;
+    list_for_each_entry_safe(oreq, n, &pool->busy_list, list){
+        if(!test_and_clear_bit(OREQ_FAILED, &oreq->flags)) continue;
+        atomic_dec(&pool->nr_failed);
+        list_del(&oreq->list);
+        list_add(&oreq->list, &pool->idle_list);
+        if(test_and_clear_bit(OREQ_STATE, &oreq->flags))
+            restore_state(odev, oreq);
+    }
+}
+
+/* free idle requests until the pool is down to nr. 
+ * must be called with odev->lock held. */
+static void shrink_req_pool(struct omimic_pool *pool, struct usb_ep *ep, 
+                            int nr)
+{
+    struct omimic_req *oreq;
+
+    if(!ep) return;
+
+    while(pool->nr_req > nr && !list_empty(&pool->idle_list)){
+        oreq = list_entry(pool->idle_list.next, struct omimic_req, list);
+        usb_ep_free_request(ep, oreq->req);
+        oreq->req = NULL;
+        list_del(&oreq->list);
+        list_add(&oreq->list, &pool->free_list);
+        pool->nr_req--;
+    }
+}
+
+static int halve_excess(const struct omimic_pool *pool)
+{
+    return pool->nr_min + (pool->nr_req - pool->nr_min) / 2;
+}
+
+/* no -EBUSY pressure for pool_idle_ms, halve the excess of the pools */
+static void omimic_pool_timer(unsigned long data)
+{
+    struct omimic_dev *odev = (struct omimic_dev *)data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&odev->lock, flags);
+    shrink_req_pool(&odev->kbd_pool, odev->kbd_ep, 
+                    halve_excess(&odev->kbd_pool));
+    shrink_req_pool(&odev->mouse_pool, odev->mouse_ep, 
+                    halve_excess(&odev->mouse_pool));
+    shrink_req_pool(&odev->pad_pool, odev->pad_ep, 
+                    halve_excess(&odev->pad_pool));
+    PDBG("request pools shrunk to %d/%d/%d\n", odev->kbd_pool.nr_req, 
+         odev->mouse_pool.nr_req, odev->pad_pool.nr_req);
+    if(odev->kbd_pool.nr_req > odev->kbd_pool.nr_min || 
+       odev->mouse_pool.nr_req > odev->mouse_pool.nr_min || 
+       odev->pad_pool.nr_req > odev->pad_pool.nr_min)
+        mod_timer(&odev->pool_timer, 
+                  jiffies + msecs_to_jiffies(pool_idle_ms));
+    spin_unlock_irqrestore(&odev->lock, flags);
+}
@@ -0,0 +1,122 @@
+/*
+ * =======================================================================
+ *
+ *       Filename:  omimic.h
+ *
+ *    Description:  the userspace interface of the omimic char device.
+ *
+ *        Version:  0.1
+ *       Compiler:  gcc
+ *
+ *         Author:  Kay Zheng (l_amee), l04m33@gmail.com
+ *
+ * =======================================================================
+ */
+
+#ifndef OMIMIC_H
+#define OMIMIC_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+
+/* 
+ * event ops. instead of writing whole reports, userspace may send
+ * events, and the driver keeps the keyboard and mouse state and 
+ * assembles the reports when the endpoints are ready.
+ */
+#define OMIMIC_EV_KEY_DOWN   1   /* code: HID usage, 0x01-0x65 or 0xe0-0xe7 */
+#define OMIMIC_EV_KEY_UP     2
+#define OMIMIC_EV_MOUSE_MOVE 3   /* code: OMIMIC_AXIS_*, value: delta */
+#define OMIMIC_EV_BTN_DOWN   4   /* code: button number, 0-2 */
+#define OMIMIC_EV_BTN_UP     5
+#define OMIMIC_EV_PAD_BTN_DOWN 6 /* code: gamepad button number, 0-15 */
+#define OMIMIC_EV_PAD_BTN_UP   7
+#define OMIMIC_EV_PAD_AXIS     8 /* code: OMIMIC_PAD_*, value: absolute */
+
+#define OMIMIC_AXIS_X     0
+#define OMIMIC_AXIS_Y     1
+#define OMIMIC_AXIS_WHEEL 2
+
+/* 
+ * gamepad axes, -32767 to 32767. the hat takes 0-7 for north, 
+ * north-east, ... north-west, anything else centers it.
+ */
+#define OMIMIC_PAD_X   0
+#define OMIMIC_PAD_Y   1
+#define OMIMIC_PAD_RX  2
+#define OMIMIC_PAD_RY  3
+#define OMIMIC_PAD_HAT 4
+
+/* 
+ * the gamepad report, as written to /dev/omimic-pad (or /dev/omimic, 
+ * where it is told apart by its size): 16 button bits, the hat in 
+ * the low nibble, then the 4 axes as little endian __s16. the gamepad 
+ * is only there when loaded with gamepad=1, otherwise its reports and 
+ * events are refused with -EINVAL and the node doesn't exist.
+ */
+#define OMIMIC_PAD_REPORT_SIZE 11
+
+struct omimic_event {
+    __u8  op;
+    __u8  code;
+    __s16 value;
+};
+
+struct omimic_event_batch {
+    __u32 nr;
+    __u32 pad;
+    __u64 events;  /* (struct omimic_event *) */
+};
+
+/* 
+ * read() on /dev/omimic or /dev/omimic-kbd returns the LED reports set 
+ * by the host, one byte each. a new reader gets the current state 
+ * first, then blocks (or polls) for changes.
+ */
+#define OMIMIC_LED_NUM_LOCK    0x01
+#define OMIMIC_LED_CAPS_LOCK   0x02
+#define OMIMIC_LED_SCROLL_LOCK 0x04
+#define OMIMIC_LED_COMPOSE     0x08
+#define OMIMIC_LED_KANA        0x10
+
+/* 
+ * the queue of one endpoint: requests idle in the pool, taken out of 
+ * it (busy), and of those, queued to the UDC and waiting for the host 
+ * to poll (in_flight). completed counts the reports taken by the host, 
+ * and wraps around.
+ */
+#define OMIMIC_EP_KBD   0
+#define OMIMIC_EP_MOUSE 1
+#define OMIMIC_EP_PAD   2
+#define OMIMIC_NR_EPS   3
+
+struct omimic_ep_stats {
+    __u32 idle;
+    __u32 busy;
+    __u32 in_flight;
+    __u32 completed;
+};
+
+struct omimic_queue_stats {
+    struct omimic_ep_stats ep[OMIMIC_NR_EPS];
+};
+
+
+#define OMIMIC_IOC_MAGIC 'O'
+
+/* returns the number of events consumed, or -EBUSY if none could be */
+#define OMIMIC_IOC_EVENTS _IOW(OMIMIC_IOC_MAGIC, 1, struct omimic_event_batch)
+
+#define OMIMIC_IOC_QUEUE_STATS \
+    _IOR(OMIMIC_IOC_MAGIC, 2, struct omimic_queue_stats)
+
+/* 
+ * signal an eventfd each time the host takes a report from the 
+ * endpoint of this node (from any endpoint, on /dev/omimic), so that 
+ * a feeder can keep pace with the polls. one eventfd per node, -1 
+ * drops it; it is also dropped when the file that set it is closed.
+ */
+#define OMIMIC_IOC_COMPLETION_EVENTFD _IOW(OMIMIC_IOC_MAGIC, 3, int)
+
+#endif
@@ -17,10 +17,91 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <linux/input.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+
+#include "libomimic.h"
+
+
+#define NR_BENCH_EVENTS 1000000
+#define NR_PAD_AXES 4
+#define NR_PAD_BTNS 16
+#define PAD_HAT_NULL 8
+#define CAP_INDEX_EVERY 1024   /* records between two index entries */
+#define MAX_CLIENTS 64
+#define NR_MSG_EVENTS 256      /* the largest batch in one message */
+#define NR_MOUSE_BTNS 3
+
+
+/* 
+ * what the gamepad translation needs besides the report state kept 
+ * by libomimic: the axis ranges of the input device, and the hat.
+ */
+struct pad {
+    struct input_absinfo abs[NR_PAD_AXES];
+    int hat_x, hat_y;
+};
+
+/* the input axes, in the order of the report */
+static const __u16 pad_axes[NR_PAD_AXES] = { ABS_X, ABS_Y, ABS_RX, ABS_RY };
+
+
+/* 
+ * the capture format. the header is followed by the records, then 
+ * by the index. a record is the time since the previous record in 
+ * us (a varint), then either an input event:
+ *     type (1 byte), code (varint), value (zigzag varint)
+ * or a HID report:
+ *     length (1 byte), the report
+ * the index has an entry for every CAP_INDEX_EVERY-th record, with 
+ * its file offset and its time since the first record.
+ * all numbers are little endian.
+ */
+#define CAP_MAGIC "OMCP"
+#define CAP_VERSION 1
+#define CAP_EVENTS 1
+#define CAP_REPORTS 2
+
+struct cap_header {
+    char  magic[4];
+    __u8  version;
+    __u8  kind;       /* CAP_EVENTS or CAP_REPORTS */
+    __u16 index_every;
+    __u32 nr_index;
+    __u32 reserved;
+    __u64 nr_records;
+    __u64 index_off;
+    __u64 duration_us;
+};
+
+struct cap_index {
+    __u64 off;
+    __u64 time_us;
+};
+
+struct capture {
+    FILE *f;
+    struct cap_header hdr;
+    __u64 last_us;       /* timestamp of the last record */
+    __u64 elapsed_us;    /* time of the last record, from the first */
+    struct cap_index *index;
+    __u32 max_index;
+};
+
+static __u64 cur_us;                /* timestamp of the event translated */
+static volatile sig_atomic_t stop;
 
 
 __u8 key_map[246] = {
@@ -96,97 +177,998 @@ __u8 key_map[246] = {
 };
 
 
-int is_down(__u8 *kc_val, __u8 key_code)
+/************* capture **************/
+
+static int put_varint(FILE *f, __u64 v)
+{
+    while(v >= 0x80){
+        putc((v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    return putc(v, f);
+}
+
+/* returns NULL if the varint runs past end */
+static const __u8 *get_varint(const __u8 *p, const __u8 *end, __u64 *v)
+{
+    int shift = 0;
+
+    *v = 0;
+    for(; p < end && shift < 64; shift += 7){
+        *v |= (__u64)(*p & 0x7f) << shift;
+        if(!(*p++ & 0x80)) return p;
+    }
+    return NULL;
+}
+
+static __u64 tv_us(const struct timeval *tv)
+{
+    return (__u64)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+struct capture *cap_open(const char *path, int kind)
+{
+    struct capture *cap = calloc(1, sizeof(*cap));
+
+    if(!cap) return NULL;
+    cap->f = fopen(path, "wb");
+    if(!cap->f){
+        free(cap);
+        return NULL;
+    }
+    memcpy(cap->hdr.magic, CAP_MAGIC, 4);
+    cap->hdr.version = CAP_VERSION;
+    cap->hdr.kind = kind;
+    cap->hdr.index_every = CAP_INDEX_EVERY;
+    /* a placeholder, until cap_close() knows the numbers */
+    fwrite(&cap->hdr, sizeof(cap->hdr), 1, cap->f);
+    return cap;
+}
+
+/* start a record at us, indexing it if its turn has come */
+static int cap_record(struct capture *cap, __u64 us)
+{
+    struct cap_index *idx;
+    __u64 delta = 0;
+
+    if(cap->hdr.nr_records){
+        /* the clock may step back, never replay that */
+        delta = us > cap->last_us ? us - cap->last_us : 0;
+        cap->elapsed_us += delta;
+    }
+    if(!cap->hdr.nr_records || us > cap->last_us) cap->last_us = us;
+
+    if(cap->hdr.nr_records % CAP_INDEX_EVERY == 0){
+        if(cap->hdr.nr_index == cap->max_index){
+            cap->max_index = cap->max_index ? 2 * cap->max_index : 64;
+            idx = realloc(cap->index, cap->max_index * sizeof(*idx));
+            if(!idx) return -1;
+            cap->index = idx;
+        }
+        idx = &cap->index[cap->hdr.nr_index++];
+        idx->off = ftell(cap->f);
+        idx->time_us = cap->elapsed_us;
+    }
+    cap->hdr.nr_records++;
+    return put_varint(cap->f, delta);
+}
+
+int cap_put_event(struct capture *cap, const struct input_event *ev)
+{
+    __u32 zz = ((__u32)ev->value << 1) ^ (__u32)(ev->value >> 31);
+
+    if(cap_record(cap, tv_us(&ev->time)) == EOF) return -1;
+    putc(ev->type, cap->f);
+    put_varint(cap->f, ev->code);
+    return put_varint(cap->f, zz) == EOF ? -1 : 0;
+}
+
+int cap_put_report(struct capture *cap, __u64 us, const void *buf, int len)
+{
+    if(cap_record(cap, us) == EOF) return -1;
+    putc(len, cap->f);
+    return fwrite(buf, len, 1, cap->f) == 1 ? 0 : -1;
+}
+
+/* write the index out and fill the header in */
+int cap_close(struct capture *cap)
+{
+    int ret = 0;
+
+    cap->hdr.index_off = ftell(cap->f);
+    cap->hdr.duration_us = cap->elapsed_us;
+    if(cap->hdr.nr_index 
+       && fwrite(cap->index, sizeof(*cap->index), cap->hdr.nr_index, 
+                 cap->f) != cap->hdr.nr_index)
+        ret = -1;
+    if(fseek(cap->f, 0, SEEK_SET) 
+       || fwrite(&cap->hdr, sizeof(cap->hdr), 1, cap->f) != 1)
+        ret = -1;
+    if(fclose(cap->f)) ret = -1;
+    free(cap->index);
+    free(cap);
+    return ret;
+}
+
+/* the report hook of libomimic, when the reports are captured */
+int cap_hook(void *arg, const void *buf, int len)
+{
+    return cap_put_report(arg, cur_us, buf, len) ? -EIO : 0;
+}
+
+void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+
+/* 
+ * the axis ranges of the input device, or the report range when it 
+ * has none (ifd < 0, or not an evdev node).
+ */
+void pad_init(struct pad *pad, int ifd)
 {
     int i;
-    for(i=2; kc_val[i]!=key_code && i<6; i++);
-    return (i<6);
+
+    memset(pad, 0, sizeof(*pad));
+    for(i=0; i<NR_PAD_AXES; i++){
+        if(ifd < 0 
+           || ioctl(ifd, EVIOCGABS(pad_axes[i]), &pad->abs[i]) 
+           || pad->abs[i].maximum <= pad->abs[i].minimum){
+            pad->abs[i].minimum = -32767;
+            pad->abs[i].maximum = 32767;
+        }
+    }
 }
 
+/* 
+ * the sticks and the hat, scaled to the report range. returns like 
+ * translate().
+ */
+int translate_pad(struct input_event *ev, struct pad *pad, struct omimic *om)
+{
+    static const __u8 hat_map[3][3] = {
+        { 7, 0, 1 },            /* up */
+        { 6, PAD_HAT_NULL, 2 }, /* centered */
+        { 5, 4, 3 },            /* down */
+    };
+    struct input_absinfo *abs;
+    int i;
+    long long v;
+
+    if(ev->code == ABS_HAT0X || ev->code == ABS_HAT0Y){
+        v = ev->value < 0 ? -1 : (ev->value > 0);
+        if(ev->code == ABS_HAT0X) pad->hat_x = v;
+        else pad->hat_y = v;
+        return omimic_pad_axis(om, OMIMIC_PAD_HAT, 
+                               hat_map[pad->hat_y + 1][pad->hat_x + 1]);
+    }
+    for(i=0; i<NR_PAD_AXES && pad_axes[i] != ev->code; i++);
+    if(i == NR_PAD_AXES) return 0;
+    abs = &pad->abs[i];
+    v = ev->value;
+    if(v < abs->minimum) v = abs->minimum;
+    if(v > abs->maximum) v = abs->maximum;
+    v = (v - abs->minimum) * 65534 / (abs->maximum - abs->minimum) - 32767;
+    return omimic_pad_axis(om, OMIMIC_PAD_X + i, v);
+}
 
-int main(int argc, char **argv)
+
+/* the HID usage of a key, 0 if it has none */
+int key_usage(__u16 code)
+{
+    switch(code){
+    case KEY_LEFTCTRL: return 0xe0;
+    case KEY_LEFTSHIFT: return 0xe1;
+    case KEY_LEFTALT: return 0xe2;
+    case KEY_LEFTMETA: return 0xe3;
+    case KEY_RIGHTCTRL: return 0xe4;
+    case KEY_RIGHTSHIFT: return 0xe5;
+    case KEY_RIGHTALT: return 0xe6;
+    case KEY_RIGHTMETA: return 0xe7;
+    }
+    return code < sizeof(key_map) ? key_map[code] : 0;
+}
+
+/* the gamepad button of a key, -1 if it is none */
+int pad_btn(__u16 code)
+{
+    if(code >= BTN_GAMEPAD && code < BTN_GAMEPAD + NR_PAD_BTNS)
+        return code - BTN_GAMEPAD;
+    if(code >= BTN_JOYSTICK && code < BTN_GAMEPAD)
+        return code - BTN_JOYSTICK;
+    return -1;
+}
+
+/* 
+ * hand one input event over to libomimic. the reports go out at 
+ * SYN_REPORT, so that all the changes of one input frame go in one 
+ * report per device. returns 0, or a negative errno.
+ */
+int translate(struct input_event *ev, struct pad *pad, struct omimic *om)
+{
+    int n;
+
+    switch(ev->type){
+    case EV_KEY:
+        if(ev->value != 0 && ev->value != 1) return 0;  /* autorepeat */
+        if((n = pad_btn(ev->code)) >= 0)
+            return ev->value ? omimic_pad_btn_down(om, n) 
+                             : omimic_pad_btn_up(om, n);
+        if(ev->code >= BTN_LEFT && ev->code <= BTN_MIDDLE){
+            n = ev->code - BTN_LEFT;
+            return ev->value ? omimic_btn_down(om, n) : omimic_btn_up(om, n);
+        }
+        if(!(n = key_usage(ev->code))) return 0;
+        return ev->value ? omimic_key_down(om, n) : omimic_key_up(om, n);
+    case EV_REL:
+        switch(ev->code){
+        case REL_X: return omimic_mouse_move(om, ev->value, 0, 0);
+        case REL_Y: return omimic_mouse_move(om, 0, ev->value, 0);
+        case REL_WHEEL: return omimic_mouse_move(om, 0, 0, ev->value);
+        }
+        return 0;
+    case EV_ABS:
+        return translate_pad(ev, pad, om);
+    case EV_SYN:
+        if(ev->code == SYN_REPORT) return omimic_flush(om);
+    }
+
+    return 0;
+}
+
+
+/************* benchmark **************/
+
+/* a key event the way a keyboard sends it: scan code, key, sync */
+int put_key(struct input_event *evs, int n, __u16 code, __s32 value)
+{
+    memset(&evs[n], 0, 3 * sizeof(*evs));
+    evs[n].type = EV_MSC;
+    evs[n].code = MSC_SCAN;
+    evs[n].value = code;
+    evs[n+1].type = EV_KEY;
+    evs[n+1].code = code;
+    evs[n+1].value = value;
+    evs[n+2].type = EV_SYN;
+    evs[n+2].code = SYN_REPORT;
+    return n + 3;
+}
+
+/* 
+ * the standard workloads:
+ *   typing     letters pressed and released one after another
+ *   chords     six keys pressed together, then released
+ *   modifiers  modifier storms around the letters
+ *   gamepad    both sticks sweeping, a button tapped now and then
+ */
+int gen_workload(const char *name, struct input_event *evs, int nr)
+{
+    static const __u16 letters[] = {
+        KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O,
+        KEY_P, KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K,
+        KEY_L, KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_N, KEY_M,
+    };
+    static const __u16 mods[] = {
+        KEY_LEFTSHIFT, KEY_LEFTCTRL, KEY_LEFTALT, KEY_RIGHTSHIFT,
+        KEY_RIGHTCTRL, KEY_RIGHTALT, KEY_LEFTMETA, KEY_RIGHTMETA,
+    };
+    int n = 0, i = 0, j;
+
+    if(!strcmp(name, "typing")){
+        while(n + 6 <= nr){
+            n = put_key(evs, n, letters[i % 26], 1);
+            n = put_key(evs, n, letters[i % 26], 0);
+            i++;
+        }
+    }else if(!strcmp(name, "chords")){
+        while(n + 36 <= nr){
+            for(j=0; j<6; j++)
+                n = put_key(evs, n, letters[(i + j) % 26], 1);
+            for(j=0; j<6; j++)
+                n = put_key(evs, n, letters[(i + j) % 26], 0);
+            i++;
+        }
+    }else if(!strcmp(name, "modifiers")){
+        while(n + 30 <= nr){
+            for(j=0; j<4; j++)
+                n = put_key(evs, n, mods[(i + j) % 8], 1);
+            n = put_key(evs, n, letters[i % 26], 1);
+            n = put_key(evs, n, letters[i % 26], 0);
+            for(j=0; j<4; j++)
+                n = put_key(evs, n, mods[(i + j) % 8], 0);
+            i++;
+        }
+    }else if(!strcmp(name, "gamepad")){
+        while(n + 6 <= nr){
+            for(j=0; j<NR_PAD_AXES; j++){
+                memset(&evs[n], 0, sizeof(*evs));
+                evs[n].type = EV_ABS;
+                evs[n].code = pad_axes[j];
+                evs[n].value = (i * 257 + j * 8191) % 65535 - 32767;
+                n++;
+            }
+            memset(&evs[n], 0, 2 * sizeof(*evs));
+            evs[n].type = EV_KEY;
+            evs[n].code = BTN_SOUTH;
+            evs[n].value = (i / 8) & 1;
+            evs[n+1].type = EV_SYN;
+            evs[n+1].code = SYN_REPORT;
+            n += 2;
+            i++;
+        }
+    }else
+        return -1;
+
+    return n;
+}
+
+/* read a recorded stream (e.g. a copy of /dev/input/eventX) at once */
+struct input_event *load_events(const char *path, int *nr)
+{
+    struct input_event *evs;
+    struct stat st;
+    int fd;
+    ssize_t len;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st)) return NULL;
+    evs = malloc(st.st_size);
+    if(!evs) return NULL;
+    len = read(fd, evs, st.st_size);
+    close(fd);
+    if(len < 0){
+        free(evs);
+        return NULL;
+    }
+    *nr = len / sizeof(*evs);
+    return evs;
+}
+
+double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* replay evs through the translation loop into ofd, and time it */
+int bench(const char *name, struct input_event *evs, int nr, int ofd)
 {
-    int pos, i, tmp;
+    struct omimic *om = omimic_new(ofd, OMIMIC_WAIT);
+    struct pad pad;
+    double t;
+    int i, ret = 0;
+
+    if(!om) return 1;
+    pad_init(&pad, -1);
+    t = now_ns();
+    for(i=0; i<nr && !ret; i++)
+        ret = translate(&evs[i], &pad, om);
+    t = now_ns() - t;
+    if(ret){
+        fprintf(stderr, "write error: %s, abort.\n", strerror(-ret));
+        omimic_free(om);
+        return 1;
+    }
+
+    printf("%-10s %9d events %9lu reports %8.1f ns/event %12.0f events/s\n",
+           name, nr, omimic_stats(om)->reports, t / nr, nr * 1e9 / t);
+    omimic_free(om);
+    return 0;
+}
+
+/************* replay **************/
+
+static double ts_us(const struct timespec *ts)
+{
+    return ts->tv_sec * 1e6 + ts->tv_nsec / 1e3;
+}
+
+/* the state caught up before going live, as the host hasn't seen it */
+static int resend_state(struct omimic *om)
+{
+    omimic_resend(om);
+    return omimic_flush(om);
+}
+
+static int held_slot(int len)
+{
+    switch(len){
+    case 8: return 0;
+    case 4: return 1;
+    case OMIMIC_PAD_REPORT_SIZE: return 2;
+    default: return -1;
+    }
+}
+
+/* 
+ * the last report of each device before going live, in a capture of 
+ * reports. the mouse keeps its buttons, its motion is in the past.
+ */
+static int resend_held(struct omimic *om, const __u8 **held)
+{
+    __u8 mouse[4];
+    int ret = 0;
+
+    if(held[0]) ret = omimic_put_report(om, held[0], 8);
+    if(held[1] && !ret){
+        memset(mouse, 0, sizeof(mouse));
+        mouse[0] = held[1][0];
+        ret = omimic_put_report(om, mouse, sizeof(mouse));
+    }
+    if(held[2] && !ret) 
+        ret = omimic_put_report(om, held[2], OMIMIC_PAD_REPORT_SIZE);
+    return ret;
+}
+
+/* 
+ * feed a capture into ofd, at its original timing unless fast is set. 
+ * the records before start_s only catch up with the state of the keys 
+ * and buttons, which goes out when the replay goes live. they are all 
+ * run through the translator: an index entry has no state to start 
+ * from, and a key held since the start must not be lost.
+ */
+int replay(const char *path, int ofd, int fast, double start_s)
+{
+    const struct cap_header *hdr;
+    const struct cap_index *index;
+    const __u8 *map, *p, *end, *report = NULL;
+    const __u8 *held[3] = { NULL };  /* last kbd/mouse/pad report */
     struct input_event ev;
-    __u8 kc_val[8];
-    __u8 key_code;
-
-    if(argc < 3) return 1;
-
-    int ifd = open(argv[1], O_RDONLY);
-    int ofd = open(argv[2], O_WRONLY);
-    if(ifd < 0 || ofd < 0) return 1;
-
-
-    memset(kc_val, 0, 8);
-    while(read(ifd, &ev, sizeof(ev)) == sizeof(ev)){
-        printf("input event -- type: %u, code: %u, value: %d\n", ev.type, ev.code, ev.value);
-        if(ev.type == EV_KEY && ev.code < 246){
-            if(ev.value == 1){ // a press-down
-                if(ev.code == KEY_LEFTCTRL){
-                    kc_val[0] |= 1 << 4;
-                }else if(ev.code == KEY_LEFTSHIFT){
-                    kc_val[0] |= 1 << 5;
-                }else if(ev.code == KEY_LEFTALT){
-                    kc_val[0] |= 1 << 6;
-                }else if(ev.code == KEY_LEFTMETA){
-                    kc_val[0] |= 1 << 7;
-                }else if(ev.code == KEY_RIGHTCTRL){
-                    kc_val[0] |= 1;
-                }else if(ev.code == KEY_RIGHTSHIFT){
-                    kc_val[0] |= 1 << 1;
-                }else if(ev.code == KEY_RIGHTALT){
-                    kc_val[0] |= 1 << 2;
-                }else if(ev.code == KEY_RIGHTMETA){
-                    kc_val[0] |= 1 << 3;
-                }else{
-                    /* other keys, check the array */
-                    key_code = key_map[ev.code];
-                    if(!is_down(kc_val, key_code)){
-                        for(pos = 2; kc_val[pos] && pos < 6; pos++);
-                        if(pos < 6) kc_val[pos] = key_code;
-                    }
-                }
-                if((tmp = write(ofd, kc_val, 8)) != 8){
-                    fprintf(stderr, "write error, len=%d, abort.\n", tmp);
-                    break;
-                }
-            }else if(ev.value == 0){ // a release
-                if(ev.code == KEY_LEFTCTRL){
-                    kc_val[0] &= ~((__u8)(1<<4));
-                }else if(ev.code == KEY_LEFTSHIFT){
-                    kc_val[0] &= ~((__u8)(1<<5));
-                }else if(ev.code == KEY_LEFTALT){
-                    kc_val[0] &= ~((__u8)(1<<6));
-                }else if(ev.code == KEY_LEFTMETA){
-                    kc_val[0] &= ~((__u8)(1<<7));
-                }else if(ev.code == KEY_RIGHTCTRL){
-                    kc_val[0] &= ~((__u8)1);
-                }else if(ev.code == KEY_RIGHTSHIFT){
-                    kc_val[0] &= ~((__u8)(1<<1));
-                }else if(ev.code == KEY_RIGHTALT){
-                    kc_val[0] &= ~((__u8)(1<<2));
-                }else if(ev.code == KEY_RIGHTMETA){
-                    kc_val[0] &= ~((__u8)(1<<3));
-                }else{
-                    /* other keys, check the array */
-                    key_code = key_map[ev.code];
-                    if(is_down(kc_val, key_code)){
-                        for(pos = 2; kc_val[pos] != key_code && pos < 6; pos++);
-                        if(pos < 6){
-                            for(i = pos; i < 5; i++)
-                                kc_val[i] = kc_val[i+1];
-                            kc_val[i] = 0;
-                        }
-                    }
-                }
-                if((tmp = write(ofd, kc_val, 8)) != 8){
-                    fprintf(stderr, "write error, len=%d, abort.\n", tmp);
-                    break;
-                }
-            }else continue;
+    struct pad pad;
+    struct omimic *om;
+    struct timespec t0, due, now;
+    struct stat st;
+    __u64 v, us = 0, start_us = start_s * 1e6, nr = 0, skipped = 0;
+    double lag, max_lag = 0;
+    int fd, out, len = 0, tmp, live = 0, ret = 0;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st)) return 1;
+    if(st.st_size < (off_t)sizeof(*hdr)){
+        fprintf(stderr, "%s: not a capture, abort.\n", path);
+        return 1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return 1;
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+    hdr = (const struct cap_header *)map;
+    if(memcmp(hdr->magic, CAP_MAGIC, 4) || hdr->version != CAP_VERSION 
+       || hdr->index_off < sizeof(*hdr) || hdr->index_off > (__u64)st.st_size 
+       || hdr->nr_index > (st.st_size - hdr->index_off) / sizeof(*index)){
+        fprintf(stderr, "%s: bad capture (unfinished?), abort.\n", path);
+        return 1;
+    }
+    index = (const struct cap_index *)(map + hdr->index_off);
+    p = map + sizeof(*hdr);
+    end = map + hdr->index_off;
+
+    /* nothing goes out until start_us, the state only catches up */
+    om = omimic_new(-1, OMIMIC_WAIT);
+    if(!om){
+        munmap((void *)map, st.st_size);
+        return 1;
+    }
+    pad_init(&pad, -1);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while(p < end && !stop){
+        p = get_varint(p, end, &v);
+        if(!p) break;
+        us += v;
+
+        if(hdr->kind == CAP_EVENTS){
+            memset(&ev, 0, sizeof(ev));
+            if(p == end) break;
+            ev.type = *p++;
+            p = get_varint(p, end, &v);
+            if(!p) break;
+            ev.code = v;
+            p = get_varint(p, end, &v);
+            if(!p) break;
+            ev.value = (__s32)((v >> 1) ^ -(v & 1));
+        }else{
+            if(p == end) break;
+            len = *p++;
+            if(len > end - p) break;
+            report = p;
+            p += len;
+        }
+        nr++;
+
+        out = us >= start_us ? ofd : -1;
+        if(out >= 0 && !live){
+            omimic_set_fd(om, ofd);
+            skipped = omimic_stats(om)->reports;
+            live = 1;
+            tmp = hdr->kind == CAP_EVENTS ? resend_state(om) 
+                                          : resend_held(om, held);
+            if(tmp){
+                fprintf(stderr, "write error: %s, abort.\n", strerror(-tmp));
+                ret = 1;
+                break;
+            }
+        }
+        if(out >= 0 && !fast){
+            v = us - start_us;
+            due.tv_sec = t0.tv_sec + v / 1000000;
+            due.tv_nsec = t0.tv_nsec + (v % 1000000) * 1000;
+            if(due.tv_nsec >= 1000000000L){
+                due.tv_nsec -= 1000000000L;
+                due.tv_sec++;
+            }
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL)
+                  && !stop);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            lag = ts_us(&now) - ts_us(&due);
+            if(lag > max_lag) max_lag = lag;
+        }
+
+        if(hdr->kind == CAP_EVENTS)
+            tmp = translate(&ev, &pad, om);
+        else if(out >= 0)
+            tmp = omimic_put_report(om, report, len);
+        else{
+            tmp = 0;
+            if(held_slot(len) >= 0) held[held_slot(len)] = report;
+        }
+        if(tmp){
+            fprintf(stderr, "write error: %s, abort.\n", strerror(-tmp));
+            ret = 1;
+            break;
+        }
+    }
+    if(p < end && !stop && !ret){
+        fprintf(stderr, "%s: truncated record %llu.\n", path, 
+                (unsigned long long)nr);
+        ret = 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("%s: %llu of %llu records, %llu reports in %.3f s "
+           "(captured %.3f s), max lag %.0f us, %lu -EBUSY retries\n",
+           path, (unsigned long long)nr, 
+           (unsigned long long)hdr->nr_records, 
+           live ? (unsigned long long)(omimic_stats(om)->reports - skipped) 
+                : 0ULL, 
+           (ts_us(&now) - ts_us(&t0)) / 1e6,
+           hdr->duration_us / 1e6, max_lag, omimic_stats(om)->busy);
+    omimic_free(om);
+    munmap((void *)map, st.st_size);
+    return ret;
+}
+
+
+/************* daemon **************/
+
+/* 
+ * many local clients on a SOCK_SEQPACKET socket, each message a batch 
+ * of struct omimic_event (see omimic.h). a client owns the keys and 
+ * buttons it pressed: only it can release them, and they are released 
+ * when it goes away. the merged state goes out as one report per 
+ * device for all the messages read at once, unless a key or button 
+ * changes twice, which pushes out the report so far.
+ */
+struct client {
+    int fd;
+    __u8 keys[32];   /* bitmap of the usages held */
+    __u8 btns;
+};
+
+/* the clients holding each key and button. libomimic merges the rest */
+struct merged {
+    __u8 key_refs[256];
+    __u8 btn_refs[NR_MOUSE_BTNS];
+};
+
+static struct client clients[MAX_CLIENTS];
+static int nr_clients;
+
+static int test_bit8(const __u8 *map, int n)
+{
+    return map[n / 8] & (1 << (n % 8));
+}
+
+static void set_bit8(__u8 *map, int n, int on)
+{
+    if(on) map[n / 8] |= 1 << (n % 8);
+    else map[n / 8] &= ~(1 << (n % 8));
+}
+
+int key_change(struct merged *m, struct client *c, int usage, int down, 
+               struct omimic *om)
+{
+    int ret;
+
+    /* a client only releases the keys it holds, and holds them once */
+    if(!!test_bit8(c->keys, usage) == down) return 0;
+    /* held by another client, nothing changes */
+    if(m->key_refs[usage] == (down ? 0 : 1)){
+        ret = down ? omimic_key_down(om, usage) : omimic_key_up(om, usage);
+        if(ret) return ret;
+    }
+    set_bit8(c->keys, usage, down);
+    if(down) m->key_refs[usage]++;
+    else m->key_refs[usage]--;
+    return 0;
+}
+
+int btn_change(struct merged *m, struct client *c, int btn, int down, 
+               struct omimic *om)
+{
+    __u8 mask = 1 << btn;
+    int ret;
+
+    if(!!(c->btns & mask) == down) return 0;
+    if(m->btn_refs[btn] == (down ? 0 : 1)){
+        ret = down ? omimic_btn_down(om, btn) : omimic_btn_up(om, btn);
+        if(ret) return ret;
+    }
+    if(down){
+        c->btns |= mask;
+        m->btn_refs[btn]++;
+    }else{
+        c->btns &= ~mask;
+        m->btn_refs[btn]--;
+    }
+    return 0;
+}
+
+int client_event(struct merged *m, struct client *c, 
+                 const struct omimic_event *ev, struct omimic *om)
+{
+    switch(ev->op){
+    case OMIMIC_EV_KEY_DOWN:
+    case OMIMIC_EV_KEY_UP:
+        if(!ev->code) return 0;
+        return key_change(m, c, ev->code, ev->op == OMIMIC_EV_KEY_DOWN, om);
+    case OMIMIC_EV_BTN_DOWN:
+    case OMIMIC_EV_BTN_UP:
+        if(ev->code >= NR_MOUSE_BTNS) return 0;
+        return btn_change(m, c, ev->code, ev->op == OMIMIC_EV_BTN_DOWN, om);
+    case OMIMIC_EV_MOUSE_MOVE:
+        switch(ev->code){
+        case OMIMIC_AXIS_X: return omimic_mouse_move(om, ev->value, 0, 0);
+        case OMIMIC_AXIS_Y: return omimic_mouse_move(om, 0, ev->value, 0);
+        case OMIMIC_AXIS_WHEEL: 
+            return omimic_mouse_move(om, 0, 0, ev->value);
+        }
+        return 0;
+    }
+    return 0;  /* unknown ops are ignored */
+}
+
+/* release whatever the client still holds */
+int client_gone(struct merged *m, struct client *c, struct omimic *om)
+{
+    int i, ret = 0;
+
+    for(i=1; i<256 && !ret; i++)
+        if(test_bit8(c->keys, i)) ret = key_change(m, c, i, 0, om);
+    for(i=0; i<NR_MOUSE_BTNS && !ret; i++)
+        if(c->btns & (1 << i)) ret = btn_change(m, c, i, 0, om);
+    close(c->fd);
+    *c = clients[--nr_clients];
+    return ret;
+}
+
+int daemon_loop(const char *path, int ofd)
+{
+    static struct merged m;
+    struct omimic_event evs[NR_MSG_EVENTS];
+    struct pollfd pfds[1 + MAX_CLIENTS];
+    struct sockaddr_un addr;
+    struct omimic *om;
+    int lfd, fd, i, j, n, ret = 0;
+    ssize_t len;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "socket path too long, abort.\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    lfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    unlink(path);
+    if(lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) 
+       || listen(lfd, 16)){
+        fprintf(stderr, "can't listen on %s, abort.\n", path);
+        return 1;
+    }
+    om = omimic_new(ofd, OMIMIC_WAIT);
+    if(!om) return 1;
+
+    while(!stop && !ret){
+        pfds[0].fd = lfd;
+        pfds[0].events = POLLIN;
+        for(i=0; i<nr_clients; i++){
+            pfds[1 + i].fd = clients[i].fd;
+            pfds[1 + i].events = POLLIN;
+        }
+        if(poll(pfds, 1 + nr_clients, -1) < 0){
+            if(errno == EINTR) continue;
+            ret = -errno;
+            break;
+        }
+
+        /* from the last client down, client_gone() moves the last one */
+        for(i=nr_clients-1; i>=0 && !ret; i--){
+            if(!pfds[1 + i].revents) continue;
+            len = recv(clients[i].fd, evs, sizeof(evs), MSG_DONTWAIT);
+            if(len < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            if(len <= 0){
+                fprintf(stderr, "client %d gone\n", clients[i].fd);
+                ret = client_gone(&m, &clients[i], om);
+                continue;
+            }
+            n = len / sizeof(evs[0]);
+            for(j=0; j<n && !ret; j++)
+                ret = client_event(&m, &clients[i], &evs[j], om);
+        }
+        if(!ret) ret = omimic_flush(om);
+
+        if(pfds[0].revents & POLLIN){
+            fd = accept(lfd, NULL, NULL);
+            if(fd >= 0 && nr_clients == MAX_CLIENTS){
+                fprintf(stderr, "too many clients, %d refused\n", fd);
+                close(fd);
+            }else if(fd >= 0){
+                memset(&clients[nr_clients], 0, sizeof(clients[0]));
+                clients[nr_clients++].fd = fd;
+                fprintf(stderr, "client %d connected\n", fd);
+            }
+        }
+    }
+    if(ret) fprintf(stderr, "write error: %s, abort.\n", strerror(-ret));
+
+    omimic_free(om);
+    close(lfd);
+    unlink(path);
+    return ret ? 1 : 0;
+}
+
+
+/************* text **************/
+
+/* the whole of path ("-" for stdin), NUL-terminated */
+static char *load_text(const char *path, size_t *len)
+{
+    int fd = strcmp(path, "-") ? open(path, O_RDONLY) : 0;
+    size_t size = 4096;
+    char *buf = NULL, *tmp;
+    ssize_t n = 0;
+
+    *len = 0;
+    if(fd < 0) return NULL;
+    do{
+        *len += n;
+        if(*len + 1 >= size || !buf){
+            if(buf) size *= 2;
+            tmp = realloc(buf, size);
+            if(!tmp){
+                n = -1;
+                break;
+            }
+            buf = tmp;
+        }
+        n = read(fd, buf + *len, size - *len - 1);
+    }while(n > 0);
+    if(fd) close(fd);
+    if(n != 0){
+        free(buf);
+        return NULL;
+    }
+    buf[*len] = '\0';
+    return buf;
+}
+
+/* type the text of path into ofd */
+int type_text(const char *path, const char *layout_name, int per_report,
+              int ofd)
+{
+    const struct omimic_layout *layout = omimic_find_layout(layout_name);
+    struct omimic *om;
+    size_t len;
+    char *text;
+    double t;
+    int ret;
+
+    if(!layout){
+        fprintf(stderr, "unknown layout %s, abort.\n", layout_name);
+        return 1;
+    }
+    text = load_text(path, &len);
+    if(!text){
+        fprintf(stderr, "can't read %s, abort.\n", path);
+        return 1;
+    }
+    om = omimic_new(ofd, OMIMIC_WAIT);
+    if(!om){
+        free(text);
+        return 1;
+    }
+
+    t = now_ns();
+    ret = omimic_type(om, text, layout, per_report);
+    t = now_ns() - t;
+    if(ret == -EILSEQ)
+        fprintf(stderr, "%s: not UTF-8, or not typeable with layout %s, "
+                "abort.\n", path, layout_name);
+    else if(ret < 0)
+        fprintf(stderr, "write error: %s, abort.\n", strerror(-ret));
+    else
+        printf("%s: %zu bytes, %d reports in %.3f s, %lu -EBUSY retries\n",
+               path, len, ret, t / 1e9, omimic_stats(om)->busy);
+    omimic_free(om);
+    free(text);
+    return ret < 0 ? 1 : 0;
+}
+
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s <input> <output>\n"
+                    "       %s -c capture [-R] <input> [output]\n"
+                    "       %s -p capture [-f] [-s seconds] <output>\n"
+                    "       %s -d socket <output>\n"
+                    "       %s -T text [-l layout] [-k keys] <output>\n"
+                    "       %s -b [-i recording | -w workload] [-n events] "
+                    "<output>\n"
+                    "-R captures the reports instead of the input events, "
+                    "-f replays as fast as possible\n"
+                    "-T types a UTF-8 file (- for stdin) with up to keys "
+                    "(1-6) keys a report\n"
+                    "layouts: us, de (default: us)\n"
+                    "workloads: typing, chords, modifiers, gamepad "
+                    "(default: all)\n",
+            prog, prog, prog, prog, prog, prog);
+}
+
+
+int main(int argc, char **argv)
+{
+    static const char *workloads[] = { "typing", "chords", "modifiers", 
+                                       "gamepad", NULL };
+    struct input_event ev, *evs;
+    struct pad pad;
+    struct capture *cap = NULL;
+    struct omimic *om;
+    struct sigaction sa;
+    int opt, tmp, i, nr = NR_BENCH_EVENTS, bench_mode = 0, ret = 0;
+    int cap_reports = 0, fast = 0, per_report = 0;
+    const char *record = NULL, *workload = NULL;
+    const char *text_path = NULL, *layout = "us";
+    const char *cap_path = NULL, *replay_path = NULL, *sock_path = NULL;
+    double start = 0;
+
+    while((opt = getopt(argc, argv, "bi:w:n:c:Rp:fs:d:T:l:k:")) != -1){
+        switch(opt){
+        case 'b': bench_mode = 1; break;
+        case 'i': record = optarg; break;
+        case 'w': workload = optarg; break;
+        case 'n': nr = atoi(optarg); break;
+        case 'c': cap_path = optarg; break;
+        case 'R': cap_reports = 1; break;
+        case 'p': replay_path = optarg; break;
+        case 'f': fast = 1; break;
+        case 's': start = atof(optarg); break;
+        case 'd': sock_path = optarg; break;
+        case 'T': text_path = optarg; break;
+        case 'l': layout = optarg; break;
+        case 'k': per_report = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(bench_mode){
+        if(argc - optind < 1 || nr <= 0){
+            usage(argv[0]);
+            return 1;
+        }
+        int ofd = open(argv[optind], O_WRONLY);
+        if(ofd < 0) return 1;
+
+        if(record){
+            evs = load_events(record, &nr);
+            if(!evs) return 1;
+            return bench(record, evs, nr, ofd);
+        }
+
+        evs = malloc(nr * sizeof(*evs));
+        if(!evs) return 1;
+        for(i=0; workloads[i]; i++){
+            if(workload && strcmp(workload, workloads[i])) continue;
+            tmp = gen_workload(workloads[i], evs, nr);
+            ret |= bench(workloads[i], evs, tmp, ofd);
+        }
+        return ret;
+    }
+
+    if(text_path){
+        if(argc - optind < 1 || per_report < 0 || per_report > 6){
+            usage(argv[0]);
+            return 1;
+        }
+        int ofd = open(argv[optind], O_WRONLY);
+        if(ofd < 0) return 1;
+        return type_text(text_path, layout, per_report, ofd);
+    }
+
+    /* stop on ^C, with the capture finished properly */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if(replay_path){
+        if(argc - optind < 1 || start < 0){
+            usage(argv[0]);
+            return 1;
+        }
+        int ofd = open(argv[optind], O_WRONLY);
+        if(ofd < 0) return 1;
+        return replay(replay_path, ofd, fast, start);
+    }
+
+    if(sock_path){
+        if(argc - optind < 1){
+            usage(argv[0]);
+            return 1;
+        }
+        int ofd = open(argv[optind], O_WRONLY);
+        if(ofd < 0) return 1;
+        signal(SIGPIPE, SIG_IGN);
+        return daemon_loop(sock_path, ofd);
+    }
+
+    /* the output is optional when capturing */
+    if(argc - optind < (cap_path ? 1 : 2)){
+        usage(argv[0]);
+        return 1;
+    }
+
+    int ifd = open(argv[optind], O_RDONLY);
+    int ofd = argc - optind > 1 ? open(argv[optind+1], O_WRONLY) : -1;
+    if(ifd < 0 || (argc - optind > 1 && ofd < 0)) return 1;
+    om = omimic_new(ofd, OMIMIC_WAIT);
+    if(!om) return 1;
+
+    if(cap_path){
+        cap = cap_open(cap_path, cap_reports ? CAP_REPORTS : CAP_EVENTS);
+        if(!cap){
+            fprintf(stderr, "can't create %s, abort.\n", cap_path);
+            return 1;
+        }
+        if(cap_reports) omimic_set_hook(om, cap_hook, cap);
+    }
+
+    pad_init(&pad, ifd);
+    while(!stop && read(ifd, &ev, sizeof(ev)) == sizeof(ev)){
+        if(!cap)
+            printf("input event -- type: %u, code: %u, value: %d\n", ev.type, ev.code, ev.value);
+        else if(!cap_reports && cap_put_event(cap, &ev)){
+            fprintf(stderr, "capture error, abort.\n");
+            break;
+        }
+        cur_us = tv_us(&ev.time);
+        tmp = translate(&ev, &pad, om);
+        if(tmp){
+            fprintf(stderr, "write error: %s, abort.\n", strerror(-tmp));
+            break;
         }
     }
+    omimic_free(om);
 
+    if(cap){
+        ret = cap_close(cap);
+        if(ret) fprintf(stderr, "can't finish %s.\n", cap_path);
+        return ret ? 1 : 0;
+    }
     return 1;
 }